@@ -0,0 +1,360 @@
+/** \file
+ *
+ *  Cycle benchmark of the firmware main loop, running the real Joystick.elf on an ATmega32U4 under
+ *  simavr. The firmware must be built with \c BENCHMARK defined (make BENCHMARK=1), so that it marks
+ *  each main loop stage in GPIOR0 and the shift timer ISR in GPIOR1, see Lib/Bench.h.
+ *
+ *  The benchmark charges every simulated cycle to the stage that was active, with shift ISR cycles
+ *  counted separately, and reports per-pass cycle counts of each stage together with the worst-case
+ *  loop period and its jitter. Four SNES pads are modelled on the data lines, and change their held
+ *  buttons every \ref BENCH_HOLD_FRAMES frames so that de-bouncing and report changes are exercised.
+ *
+ *  There is no USB host: the firmware forces itself into the configured state, and every read of
+ *  UEINTX reports the selected endpoint as ready for IN data, which is the worst case for HID_Task().
+ *
+ *  Each call of the shift timer ISR is also timed on its own, from the vector to the \c reti, so that
+ *  interrupt entry and exit are counted, which the GPIOR1 marker inside the handler cannot see.
+ *
+ *  Usage: make BENCHMARK=1 && make bench_run, or JoystickBench [firmware.elf] [milliseconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/avr_ioport.h>
+
+#include "Lib/Bench.h"
+
+/** Data space addresses of the ATmega32U4 registers used by the benchmark. */
+#define BENCH_ADDR_GPIOR0         0x3E
+#define BENCH_ADDR_GPIOR1         0x4A
+#define BENCH_ADDR_PLLCSR         0x49
+#define BENCH_ADDR_UEINTX         0xE8
+
+/** UEINTX bits reported for every endpoint: TXINI (bank free) and RWAL (read/write allowed). */
+#define BENCH_UEINTX_READY        ((1 << 0) | (1 << 5))
+
+/** PLLCSR lock bit, reported set so that USB_Init() does not wait forever on the missing PLL model. */
+#define BENCH_PLLCSR_PLOCK        (1 << 0)
+
+#define BENCH_F_CPU               16000000UL
+
+/** Byte address of the Timer 3 compare A vector (vector 32) of the ATmega32U4, the shift timer ISR. */
+#define BENCH_SHIFT_VECTOR        (32 * 4)
+
+/** Opcode of the \c reti instruction. */
+#define BENCH_OPCODE_RETI         0x9518
+
+/** Number of SNES frames the modelled pads hold each button pattern, long enough to pass de-bouncing. */
+#define BENCH_HOLD_FRAMES         16
+
+/** Loop passes skipped before statistics are gathered, covering start-up and USB_Init(). */
+#define BENCH_WARMUP_PASSES       100
+
+/** Cycle statistics of one stage, taken per main loop pass. */
+typedef struct
+{
+	uint64_t Total;
+	uint32_t Min;
+	uint32_t Max;
+} Bench_Stat_t;
+
+static const char* const StageNames[BENCH_STAGE_Count] =
+{
+	"(startup)",
+	"readJoystickStates",
+	"performDebounce",
+	"HID_Task",
+	"GetNextReport(0)",
+	"GetNextReport(1)",
+	"GetNextReport(2)",
+	"GetNextReport(3)",
+	"USB_USBTask",
+};
+
+/** Data pins of the four SNES ports, as port letter and bit. */
+static const struct
+{
+	char    Port;
+	uint8_t Bit;
+} DataPins[4] = {{'F', 5}, {'F', 4}, {'B', 5}, {'B', 2}};
+
+static avr_t*       AVR;
+
+static uint8_t      CurrentStage;
+static bool         InISR;
+static avr_cycle_count_t LastMarkCycle;
+
+static uint32_t     PassCycles[BENCH_STAGE_Count];
+static uint32_t     PassISRCycles;
+static avr_cycle_count_t PassStartCycle;
+
+static uint32_t     Passes;
+static Bench_Stat_t StageStats[BENCH_STAGE_Count];
+static Bench_Stat_t ISRStats;
+static Bench_Stat_t ISRCallStats;
+static uint32_t     ISRCalls;
+static Bench_Stat_t PeriodStats;
+static double       PeriodSumSquares;
+
+static uint16_t     PadPressed[4];
+static uint32_t     PadShift[4];
+static uint32_t     Frames;
+static bool         LatchLevel;
+static bool         ClockLevel;
+
+static void Bench_AddSample(Bench_Stat_t* const Stat, const uint32_t Cycles)
+{
+	if (!(Passes) || (Cycles < Stat->Min))
+	  Stat->Min = Cycles;
+	if (Cycles > Stat->Max)
+	  Stat->Max = Cycles;
+
+	Stat->Total += Cycles;
+}
+
+/** Charges the cycles since the last marker to the stage or ISR that was running. */
+static void Bench_Charge(void)
+{
+	uint32_t Delta = (uint32_t)(AVR->cycle - LastMarkCycle);
+
+	if (InISR)
+	  PassISRCycles += Delta;
+	else
+	  PassCycles[CurrentStage] += Delta;
+
+	LastMarkCycle = AVR->cycle;
+}
+
+/** Closes a main loop pass when the next one starts, folding its per-stage cycles into the statistics. */
+static void Bench_EndPass(void)
+{
+	static uint32_t SeenPasses;
+	uint32_t        Period = (uint32_t)(AVR->cycle - PassStartCycle);
+
+	if (SeenPasses++ >= BENCH_WARMUP_PASSES)
+	{
+		for (uint8_t Stage = 0; Stage < BENCH_STAGE_Count; Stage++)
+		  Bench_AddSample(&StageStats[Stage], PassCycles[Stage]);
+
+		Bench_AddSample(&ISRStats, PassISRCycles);
+		Bench_AddSample(&PeriodStats, Period);
+		PeriodSumSquares += ((double)Period * Period);
+
+		Passes++;
+	}
+
+	for (uint8_t Stage = 0; Stage < BENCH_STAGE_Count; Stage++)
+	  PassCycles[Stage] = 0;
+
+	PassISRCycles  = 0;
+	PassStartCycle = AVR->cycle;
+}
+
+static void Bench_OnStageWrite(struct avr_t* avr, avr_io_addr_t Address, uint8_t Value, void* Param)
+{
+	avr->data[Address] = Value;
+
+	Bench_Charge();
+
+	if (Value == BENCH_STAGE_Read)
+	  Bench_EndPass();
+
+	CurrentStage = (Value < BENCH_STAGE_Count) ? Value : BENCH_STAGE_None;
+}
+
+static void Bench_OnISRWrite(struct avr_t* avr, avr_io_addr_t Address, uint8_t Value, void* Param)
+{
+	avr->data[Address] = Value;
+
+	Bench_Charge();
+	InISR = (Value != 0);
+}
+
+static uint8_t Bench_OnPLLRead(struct avr_t* avr, avr_io_addr_t Address, void* Param)
+{
+	return (avr->data[Address] | BENCH_PLLCSR_PLOCK);
+}
+
+static uint8_t Bench_OnEndpointRead(struct avr_t* avr, avr_io_addr_t Address, void* Param)
+{
+	return BENCH_UEINTX_READY;
+}
+
+/** Small deterministic generator so that every run presents the same button sequence. */
+static uint16_t Bench_Random(void)
+{
+	static uint32_t State = 0x12345678;
+
+	State = (State * 1103515245UL) + 12345;
+	return (State >> 16);
+}
+
+/** Drives each pad's data line from the top of its shift register, low while a button is held. */
+static void Bench_DriveDataLines(void)
+{
+	for (uint8_t Pad = 0; Pad < 4; Pad++)
+	{
+		avr_irq_t* Pin = avr_io_getirq(AVR, AVR_IOCTL_IOPORT_GETIRQ(DataPins[Pad].Port), DataPins[Pad].Bit);
+
+		avr_raise_irq(Pin, PadShift[Pad] & 1);
+	}
+}
+
+/** Latch line (PF6): while high, every 4021 loads its buttons. */
+static void Bench_OnLatch(struct avr_irq_t* IRQ, uint32_t Value, void* Param)
+{
+	if (Value && !(LatchLevel))
+	{
+		if (!(++Frames % BENCH_HOLD_FRAMES))
+		{
+			for (uint8_t Pad = 0; Pad < 4; Pad++)
+			  PadPressed[Pad] = (Bench_Random() & 0x0FFF);
+		}
+	}
+
+	LatchLevel = Value;
+
+	if (LatchLevel)
+	{
+		for (uint8_t Pad = 0; Pad < 4; Pad++)
+		  PadShift[Pad] = ((uint32_t)~PadPressed[Pad] & 0x0FFF) | 0xF000;
+
+		Bench_DriveDataLines();
+	}
+}
+
+/** Clock line (PF7, or PC6 with the hardware shift clock): a rising edge with the latch low shifts every 4021 by one bit. */
+static void Bench_OnClock(struct avr_irq_t* IRQ, uint32_t Value, void* Param)
+{
+	if (Value && !(ClockLevel) && !(LatchLevel))
+	{
+		for (uint8_t Pad = 0; Pad < 4; Pad++)
+		  PadShift[Pad] >>= 1;
+
+		Bench_DriveDataLines();
+	}
+
+	ClockLevel = Value;
+}
+
+static void Bench_PrintStat(const char* const Name, const Bench_Stat_t* const Stat)
+{
+	printf("  %-20s %8u %10.1f %8u\n", Name, Stat->Min, (double)Stat->Total / Passes, Stat->Max);
+}
+
+/** Runs one instruction, timing the shift timer ISR from the instruction that lands on its vector to its \c reti. */
+static int Bench_Step(void)
+{
+	static bool              InShiftISR;
+	static avr_cycle_count_t ShiftISRStart;
+
+	const avr_cycle_count_t Start  = AVR->cycle;
+	const bool              Return = (InShiftISR &&
+	                                  (((AVR->flash[AVR->pc + 1] << 8) | AVR->flash[AVR->pc]) == BENCH_OPCODE_RETI));
+
+	int State = avr_run(AVR);
+
+	if (Return)
+	{
+		uint32_t Cycles = (uint32_t)(AVR->cycle - ShiftISRStart);
+
+		if (!(ISRCalls) || (Cycles < ISRCallStats.Min))
+		  ISRCallStats.Min = Cycles;
+		if (Cycles > ISRCallStats.Max)
+		  ISRCallStats.Max = Cycles;
+
+		ISRCallStats.Total += Cycles;
+		ISRCalls++;
+		InShiftISR = false;
+	}
+	else if (!(InShiftISR) && (AVR->pc == BENCH_SHIFT_VECTOR))
+	{
+		ShiftISRStart = Start;
+		InShiftISR    = true;
+	}
+
+	return State;
+}
+
+
+int main(int argc, char** argv)
+{
+	const char*    Firmware = (argc > 1) ? argv[1] : "Joystick.elf";
+	uint32_t       RunMS    = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1000;
+	elf_firmware_t ELF      = {{0}};
+
+	if (elf_read_firmware(Firmware, &ELF))
+	{
+		fprintf(stderr, "Unable to load %s\n", Firmware);
+		return 1;
+	}
+
+	if (!(AVR = avr_make_mcu_by_name("atmega32u4")))
+	{
+		fprintf(stderr, "simavr has no ATmega32U4 core\n");
+		return 1;
+	}
+
+	avr_init(AVR);
+	avr_load_firmware(AVR, &ELF);
+	AVR->frequency = BENCH_F_CPU;
+
+	avr_register_io_write(AVR, BENCH_ADDR_GPIOR0, Bench_OnStageWrite, NULL);
+	avr_register_io_write(AVR, BENCH_ADDR_GPIOR1, Bench_OnISRWrite, NULL);
+	avr_register_io_read(AVR, BENCH_ADDR_PLLCSR, Bench_OnPLLRead, NULL);
+	avr_register_io_read(AVR, BENCH_ADDR_UEINTX, Bench_OnEndpointRead, NULL);
+
+	avr_irq_register_notify(avr_io_getirq(AVR, AVR_IOCTL_IOPORT_GETIRQ('F'), 6), Bench_OnLatch, NULL);
+	avr_irq_register_notify(avr_io_getirq(AVR, AVR_IOCTL_IOPORT_GETIRQ('F'), 7), Bench_OnClock, NULL);
+	avr_irq_register_notify(avr_io_getirq(AVR, AVR_IOCTL_IOPORT_GETIRQ('C'), 6), Bench_OnClock, NULL);
+
+	avr_cycle_count_t EndCycle = ((avr_cycle_count_t)RunMS * (BENCH_F_CPU / 1000));
+
+	while (AVR->cycle < EndCycle)
+	{
+		int State = Bench_Step();
+
+		if ((State == cpu_Done) || (State == cpu_Crashed))
+		{
+			fprintf(stderr, "Firmware stopped after %llu cycles\n", (unsigned long long)AVR->cycle);
+			return 1;
+		}
+	}
+
+	if (!(Passes))
+	{
+		fprintf(stderr, "No main loop passes seen, was the firmware built with BENCHMARK=1?\n");
+		return 1;
+	}
+
+	double Mean   = (double)PeriodStats.Total / Passes;
+	double StdDev = sqrt((PeriodSumSquares / Passes) - (Mean * Mean));
+
+	printf("%u ms simulated, %u loop passes measured, %u SNES frames\n\n", RunMS, Passes, Frames);
+	printf("cycles per loop pass:     min        avg      max\n");
+
+	for (uint8_t Stage = BENCH_STAGE_Read; Stage < BENCH_STAGE_Count; Stage++)
+	  Bench_PrintStat(StageNames[Stage], &StageStats[Stage]);
+
+	Bench_PrintStat("shift timer ISR", &ISRStats);
+	Bench_PrintStat("loop period", &PeriodStats);
+
+	printf("\nworst-case loop period: %u cycles (%.2f us)\n", PeriodStats.Max, PeriodStats.Max * 1e6 / BENCH_F_CPU);
+	printf("loop period jitter: %u cycles peak-to-peak, %.1f cycles standard deviation\n",
+	       PeriodStats.Max - PeriodStats.Min, StdDev);
+
+	if (ISRCalls)
+	{
+		printf("shift timer ISR per call, vector to reti: %u min, %.1f avg, %u max cycles over %u calls\n",
+		       ISRCallStats.Min, (double)ISRCallStats.Total / ISRCalls, ISRCallStats.Max, ISRCalls);
+	}
+
+	return 0;
+}
@@ -37,17 +37,28 @@
 
 #include "Descriptors.h"
 
+/** Expands ENTRY(n) once for each n below Count, which must be a literal or a macro expanding to one. */
+#define JOYSTICK_ENTRIES_1(ENTRY)  ENTRY(0)
+#define JOYSTICK_ENTRIES_2(ENTRY)  JOYSTICK_ENTRIES_1(ENTRY) ENTRY(1)
+#define JOYSTICK_ENTRIES_3(ENTRY)  JOYSTICK_ENTRIES_2(ENTRY) ENTRY(2)
+#define JOYSTICK_ENTRIES_4(ENTRY)  JOYSTICK_ENTRIES_3(ENTRY) ENTRY(3)
+#define JOYSTICK_ENTRIES(Count, ENTRY)  CONCAT_EXPANDED(JOYSTICK_ENTRIES_, Count)(ENTRY)
+
+#if (HAL_SNES_PORTS > 4)
+	#error JOYSTICK_ENTRIES must be extended to the number of SNES ports on the board.
+#endif
+
+#if !defined(JOYSTICK_MULTIPLEXED)
 /** HID class report descriptor. This is a special descriptor constructed with values from the
  *  USBIF HID class specification to describe the reports and capabilities of the HID device. This
  *  descriptor is parsed by the host and its contents used to determine what data (and in what encoding)
  *  the device will send, and what it may be sent back from the host. Refer to the HID specification for
  *  more details on HID report descriptors.
+ *
+ *  Every joystick interface shares this one report descriptor. The item sizes and counts come from the
+ *  JOYSTICK_REPORT_* macros in Descriptors.h, against which the report structure is checked.
  */
-
-
-
-
-const USB_Descriptor_HIDReport_Datatype_t PROGMEM JoystickReport0[] =
+const USB_Descriptor_HIDReport_Datatype_t PROGMEM JoystickReport[] =
 {
 	HID_RI_USAGE_PAGE(8,1), /* Generic Desktop */
 	HID_RI_USAGE(8,5), /* Joystick */
@@ -73,16 +84,16 @@ const USB_Descriptor_HIDReport_Datatype_t PROGMEM JoystickReport0[] =
 		*/
 		// Below are my modified descriptors, which allow for up to 16 buttons.
 		HID_RI_REPORT_SIZE(8,1),
-		HID_RI_REPORT_COUNT(8,16),
+		HID_RI_REPORT_COUNT(8,JOYSTICK_REPORT_BUTTONS),
 		HID_RI_USAGE_PAGE(8,9),
 		HID_RI_USAGE_MINIMUM(8,1),
-		HID_RI_USAGE_MAXIMUM(8,16),
+		HID_RI_USAGE_MAXIMUM(8,JOYSTICK_REPORT_BUTTONS),
 		HID_RI_INPUT(8,2),
 		/* HAT Switch (1 nibble) */
 		HID_RI_USAGE_PAGE(8,1),
 		HID_RI_LOGICAL_MAXIMUM(8,7),
 		HID_RI_PHYSICAL_MAXIMUM(16,315),
-		HID_RI_REPORT_SIZE(8,4),
+		HID_RI_REPORT_SIZE(8,JOYSTICK_REPORT_HAT_BITS),
 		HID_RI_REPORT_COUNT(8,1),
 		HID_RI_UNIT(8,20),
 		HID_RI_USAGE(8,57),
@@ -100,13 +111,13 @@ const USB_Descriptor_HIDReport_Datatype_t PROGMEM JoystickReport0[] =
 		HID_RI_USAGE(8,50),
 		HID_RI_USAGE(8,53),
 		HID_RI_REPORT_SIZE(8,8),
-		HID_RI_REPORT_COUNT(8,4),
+		HID_RI_REPORT_COUNT(8,JOYSTICK_REPORT_AXES),
 		HID_RI_INPUT(8,2),
 		/* ??? Vendor Specific (1 byte) */
 		// I'm unsure as to what this specific byte is used for; I'll continue to investigate this now that I have a means to analyze the USB protocol when connected to the Switch and Wii U.
 		HID_RI_USAGE_PAGE(16,65280),
 		HID_RI_USAGE(8,32),
-		HID_RI_REPORT_COUNT(8,1),
+		HID_RI_REPORT_COUNT(8,JOYSTICK_REPORT_VENDOR_BYTES),
 		HID_RI_INPUT(8,2),
 		// Output (8 bytes)
 		// Unsure of what this is used for, but simply allocating memory, performing the read and not doing anything with it has worked in both cases.
@@ -115,212 +126,66 @@ const USB_Descriptor_HIDReport_Datatype_t PROGMEM JoystickReport0[] =
 		HID_RI_OUTPUT(8,2),
 	HID_RI_END_COLLECTION(0),
 };
-const USB_Descriptor_HIDReport_Datatype_t PROGMEM JoystickReport1[] =
-{
-	HID_RI_USAGE_PAGE(8,1), /* Generic Desktop */
-	HID_RI_USAGE(8,5), /* Joystick */
-	HID_RI_COLLECTION(8,1), /* Application */
-		/* Buttons (2 bytes) */
-		HID_RI_LOGICAL_MINIMUM(8,0),
-		HID_RI_LOGICAL_MAXIMUM(8,1),
-		HID_RI_PHYSICAL_MINIMUM(8,0),
-		HID_RI_PHYSICAL_MAXIMUM(8,1),
-		/*
-		This block is the original set of descriptors from the Pokken controller.
-		This allows for a total of 13 buttons.
-
-		HID_RI_REPORT_SIZE(8,1),
-		HID_RI_REPORT_COUNT(8,13),
-		HID_RI_USAGE_PAGE(8,9),
-		HID_RI_USAGE_MINIMUM(8,1),
-		HID_RI_USAGE_MAXIMUM(8,13),
-		HID_RI_INPUT(8,2),
-
-		HID_RI_REPORT_COUNT(8,3),
-		HID_RI_INPUT(8,1),
-		*/
-		// Below are my modified descriptors, which allow for up to 16 buttons.
-		HID_RI_REPORT_SIZE(8,1),
-		HID_RI_REPORT_COUNT(8,16),
-		HID_RI_USAGE_PAGE(8,9),
-		HID_RI_USAGE_MINIMUM(8,1),
-		HID_RI_USAGE_MAXIMUM(8,16),
-		HID_RI_INPUT(8,2),
-		/* HAT Switch (1 nibble) */
-		HID_RI_USAGE_PAGE(8,1),
-		HID_RI_LOGICAL_MAXIMUM(8,7),
-		HID_RI_PHYSICAL_MAXIMUM(16,315),
-		HID_RI_REPORT_SIZE(8,4),
-		HID_RI_REPORT_COUNT(8,1),
-		HID_RI_UNIT(8,20),
-		HID_RI_USAGE(8,57),
-		HID_RI_INPUT(8,66),
-		// The Switch Pro Controller -does- have the joysticks come before the HAT.
-		// However, we may still be able to repurpose this nibble into those additional 4 buttons.
-		HID_RI_UNIT(8,0),
-		HID_RI_REPORT_COUNT(8,1),
-		HID_RI_INPUT(8,1),
-		/* Joystick (4 bytes) */
-		HID_RI_LOGICAL_MAXIMUM(16,255),
-		HID_RI_PHYSICAL_MAXIMUM(16,255),
-		HID_RI_USAGE(8,48),
-		HID_RI_USAGE(8,49),
-		HID_RI_USAGE(8,50),
-		HID_RI_USAGE(8,53),
-		HID_RI_REPORT_SIZE(8,8),
-		HID_RI_REPORT_COUNT(8,4),
-		HID_RI_INPUT(8,2),
-		/* ??? Vendor Specific (1 byte) */
-		// I'm unsure as to what this specific byte is used for; I'll continue to investigate this now that I have a means to analyze the USB protocol when connected to the Switch and Wii U.
-		HID_RI_USAGE_PAGE(16,65280),
-		HID_RI_USAGE(8,32),
-		HID_RI_REPORT_COUNT(8,1),
-		HID_RI_INPUT(8,2),
-		// Output (8 bytes)
-		// Unsure of what this is used for, but simply allocating memory, performing the read and not doing anything with it has worked in both cases.
-		HID_RI_USAGE(16,9761),
-		HID_RI_REPORT_COUNT(8,8),
-		HID_RI_OUTPUT(8,2),
+#else
+/** Report items of pad n within the multiplexed report: the same fields as the single pad report above, in
+ *  a logical collection of their own. Each pad numbers its buttons from n * 16 + 1 so that hosts can tell
+ *  the pads' buttons apart; the axes and HAT repeat the same usages in every collection.
+ */
+#define JOYSTICK_PAD_REPORT_ITEMS(Pad)                                        \
+	HID_RI_COLLECTION(8,2), /* Logical */                                     \
+		HID_RI_LOGICAL_MINIMUM(8,0),                                          \
+		HID_RI_LOGICAL_MAXIMUM(8,1),                                          \
+		HID_RI_PHYSICAL_MINIMUM(8,0),                                         \
+		HID_RI_PHYSICAL_MAXIMUM(8,1),                                         \
+		HID_RI_REPORT_SIZE(8,1),                                              \
+		HID_RI_REPORT_COUNT(8,JOYSTICK_REPORT_BUTTONS),                       \
+		HID_RI_USAGE_PAGE(8,9),                                               \
+		HID_RI_USAGE_MINIMUM(8,((Pad) * JOYSTICK_REPORT_BUTTONS) + 1),        \
+		HID_RI_USAGE_MAXIMUM(8,((Pad) + 1) * JOYSTICK_REPORT_BUTTONS),        \
+		HID_RI_INPUT(8,2),                                                    \
+		HID_RI_USAGE_PAGE(8,1),                                               \
+		HID_RI_LOGICAL_MAXIMUM(8,7),                                          \
+		HID_RI_PHYSICAL_MAXIMUM(16,315),                                      \
+		HID_RI_REPORT_SIZE(8,JOYSTICK_REPORT_HAT_BITS),                       \
+		HID_RI_REPORT_COUNT(8,1),                                             \
+		HID_RI_UNIT(8,20),                                                    \
+		HID_RI_USAGE(8,57),                                                   \
+		HID_RI_INPUT(8,66),                                                   \
+		HID_RI_UNIT(8,0),                                                     \
+		HID_RI_REPORT_COUNT(8,1),                                             \
+		HID_RI_INPUT(8,1),                                                    \
+		HID_RI_LOGICAL_MAXIMUM(16,255),                                       \
+		HID_RI_PHYSICAL_MAXIMUM(16,255),                                      \
+		HID_RI_USAGE(8,48),                                                   \
+		HID_RI_USAGE(8,49),                                                   \
+		HID_RI_USAGE(8,50),                                                   \
+		HID_RI_USAGE(8,53),                                                   \
+		HID_RI_REPORT_SIZE(8,8),                                              \
+		HID_RI_REPORT_COUNT(8,JOYSTICK_REPORT_AXES),                          \
+		HID_RI_INPUT(8,2),                                                    \
+		HID_RI_USAGE_PAGE(16,65280),                                          \
+		HID_RI_USAGE(8,32),                                                   \
+		HID_RI_REPORT_COUNT(8,JOYSTICK_REPORT_VENDOR_BYTES),                  \
+		HID_RI_INPUT(8,2),                                                    \
 	HID_RI_END_COLLECTION(0),
-};
 
-const USB_Descriptor_HIDReport_Datatype_t PROGMEM JoystickReport2[] =
+/** HID class report descriptor of the multiplexed interface. Every input report carries all pads back to
+ *  back, pad 0 first, so the host collects them all in one IN transaction. The 8 byte output report is
+ *  kept as in the single pad report.
+ */
+const USB_Descriptor_HIDReport_Datatype_t PROGMEM JoystickReport[] =
 {
 	HID_RI_USAGE_PAGE(8,1), /* Generic Desktop */
 	HID_RI_USAGE(8,5), /* Joystick */
 	HID_RI_COLLECTION(8,1), /* Application */
-		/* Buttons (2 bytes) */
-		HID_RI_LOGICAL_MINIMUM(8,0),
-		HID_RI_LOGICAL_MAXIMUM(8,1),
-		HID_RI_PHYSICAL_MINIMUM(8,0),
-		HID_RI_PHYSICAL_MAXIMUM(8,1),
-		/*
-		This block is the original set of descriptors from the Pokken controller.
-		This allows for a total of 13 buttons.
-
-		HID_RI_REPORT_SIZE(8,1),
-		HID_RI_REPORT_COUNT(8,13),
-		HID_RI_USAGE_PAGE(8,9),
-		HID_RI_USAGE_MINIMUM(8,1),
-		HID_RI_USAGE_MAXIMUM(8,13),
-		HID_RI_INPUT(8,2),
-
-		HID_RI_REPORT_COUNT(8,3),
-		HID_RI_INPUT(8,1),
-		*/
-		// Below are my modified descriptors, which allow for up to 16 buttons.
-		HID_RI_REPORT_SIZE(8,1),
-		HID_RI_REPORT_COUNT(8,16),
-		HID_RI_USAGE_PAGE(8,9),
-		HID_RI_USAGE_MINIMUM(8,1),
-		HID_RI_USAGE_MAXIMUM(8,16),
-		HID_RI_INPUT(8,2),
-		/* HAT Switch (1 nibble) */
-		HID_RI_USAGE_PAGE(8,1),
-		HID_RI_LOGICAL_MAXIMUM(8,7),
-		HID_RI_PHYSICAL_MAXIMUM(16,315),
-		HID_RI_REPORT_SIZE(8,4),
-		HID_RI_REPORT_COUNT(8,1),
-		HID_RI_UNIT(8,20),
-		HID_RI_USAGE(8,57),
-		HID_RI_INPUT(8,66),
-		// The Switch Pro Controller -does- have the joysticks come before the HAT.
-		// However, we may still be able to repurpose this nibble into those additional 4 buttons.
-		HID_RI_UNIT(8,0),
-		HID_RI_REPORT_COUNT(8,1),
-		HID_RI_INPUT(8,1),
-		/* Joystick (4 bytes) */
-		HID_RI_LOGICAL_MAXIMUM(16,255),
-		HID_RI_PHYSICAL_MAXIMUM(16,255),
-		HID_RI_USAGE(8,48),
-		HID_RI_USAGE(8,49),
-		HID_RI_USAGE(8,50),
-		HID_RI_USAGE(8,53),
-		HID_RI_REPORT_SIZE(8,8),
-		HID_RI_REPORT_COUNT(8,4),
-		HID_RI_INPUT(8,2),
-		/* ??? Vendor Specific (1 byte) */
-		// I'm unsure as to what this specific byte is used for; I'll continue to investigate this now that I have a means to analyze the USB protocol when connected to the Switch and Wii U.
-		HID_RI_USAGE_PAGE(16,65280),
-		HID_RI_USAGE(8,32),
-		HID_RI_REPORT_COUNT(8,1),
-		HID_RI_INPUT(8,2),
-		// Output (8 bytes)
-		// Unsure of what this is used for, but simply allocating memory, performing the read and not doing anything with it has worked in both cases.
+		JOYSTICK_ENTRIES(JOYSTICK_PAD_COUNT, JOYSTICK_PAD_REPORT_ITEMS)
 		HID_RI_USAGE(16,9761),
 		HID_RI_REPORT_COUNT(8,8),
 		HID_RI_OUTPUT(8,2),
 	HID_RI_END_COLLECTION(0),
 };
+#endif
 
-const USB_Descriptor_HIDReport_Datatype_t PROGMEM JoystickReport3[] =
-{
-	HID_RI_USAGE_PAGE(8,1), /* Generic Desktop */
-	HID_RI_USAGE(8,5), /* Joystick */
-	HID_RI_COLLECTION(8,1), /* Application */
-		/* Buttons (2 bytes) */
-		HID_RI_LOGICAL_MINIMUM(8,0),
-		HID_RI_LOGICAL_MAXIMUM(8,1),
-		HID_RI_PHYSICAL_MINIMUM(8,0),
-		HID_RI_PHYSICAL_MAXIMUM(8,1),
-		/*
-		This block is the original set of descriptors from the Pokken controller.
-		This allows for a total of 13 buttons.
-
-		HID_RI_REPORT_SIZE(8,1),
-		HID_RI_REPORT_COUNT(8,13),
-		HID_RI_USAGE_PAGE(8,9),
-		HID_RI_USAGE_MINIMUM(8,1),
-		HID_RI_USAGE_MAXIMUM(8,13),
-		HID_RI_INPUT(8,2),
-
-		HID_RI_REPORT_COUNT(8,3),
-		HID_RI_INPUT(8,1),
-		*/
-		// Below are my modified descriptors, which allow for up to 16 buttons.
-		HID_RI_REPORT_SIZE(8,1),
-		HID_RI_REPORT_COUNT(8,16),
-		HID_RI_USAGE_PAGE(8,9),
-		HID_RI_USAGE_MINIMUM(8,1),
-		HID_RI_USAGE_MAXIMUM(8,16),
-		HID_RI_INPUT(8,2),
-		/* HAT Switch (1 nibble) */
-		HID_RI_USAGE_PAGE(8,1),
-		HID_RI_LOGICAL_MAXIMUM(8,7),
-		HID_RI_PHYSICAL_MAXIMUM(16,315),
-		HID_RI_REPORT_SIZE(8,4),
-		HID_RI_REPORT_COUNT(8,1),
-		HID_RI_UNIT(8,20),
-		HID_RI_USAGE(8,57),
-		HID_RI_INPUT(8,66),
-		// The Switch Pro Controller -does- have the joysticks come before the HAT.
-		// However, we may still be able to repurpose this nibble into those additional 4 buttons.
-		HID_RI_UNIT(8,0),
-		HID_RI_REPORT_COUNT(8,1),
-		HID_RI_INPUT(8,1),
-		/* Joystick (4 bytes) */
-		HID_RI_LOGICAL_MAXIMUM(16,255),
-		HID_RI_PHYSICAL_MAXIMUM(16,255),
-		HID_RI_USAGE(8,48),
-		HID_RI_USAGE(8,49),
-		HID_RI_USAGE(8,50),
-		HID_RI_USAGE(8,53),
-		HID_RI_REPORT_SIZE(8,8),
-		HID_RI_REPORT_COUNT(8,4),
-		HID_RI_INPUT(8,2),
-		/* ??? Vendor Specific (1 byte) */
-		// I'm unsure as to what this specific byte is used for; I'll continue to investigate this now that I have a means to analyze the USB protocol when connected to the Switch and Wii U.
-		HID_RI_USAGE_PAGE(16,65280),
-		HID_RI_USAGE(8,32),
-		HID_RI_REPORT_COUNT(8,1),
-		HID_RI_INPUT(8,2),
-		// Output (8 bytes)
-		// Unsure of what this is used for, but simply allocating memory, performing the read and not doing anything with it has worked in both cases.
-		HID_RI_USAGE(16,9761),
-		HID_RI_REPORT_COUNT(8,8),
-		HID_RI_OUTPUT(8,2),
-	HID_RI_END_COLLECTION(0),
-};
 /** Device descriptor structure. This descriptor, located in FLASH memory, describes the overall
  *  device characteristics, including the supported USB version, control endpoint size and the
  *  number of device configurations. The descriptor is read out by the USB host when the enumeration
@@ -348,6 +213,40 @@ const USB_Descriptor_Device_t PROGMEM DeviceDescriptor =
 	.NumberOfConfigurations = FIXED_NUM_CONFIGURATIONS
 };
 
+/** Descriptors of joystick interface n: the interface, its HID class descriptor and IN endpoint n + 1. */
+#define JOYSTICK_DESCRIPTORS(Index)                                                                      \
+	{                                                                                                    \
+		.Interface =                                                                                     \
+			{                                                                                            \
+				.Header                 = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface}, \
+				.InterfaceNumber        = (Index),                                                       \
+				.AlternateSetting       = 0x00,                                                          \
+				.TotalEndpoints         = 1,                                                             \
+				.Class                  = HID_CSCP_HIDClass,                                             \
+				.SubClass               = HID_CSCP_NonBootSubclass,                                      \
+				.Protocol               = HID_CSCP_NonBootProtocol,                                      \
+				.InterfaceStrIndex      = NO_DESCRIPTOR                                                  \
+			},                                                                                           \
+		.JoystickHID =                                                                                   \
+			{                                                                                            \
+				.Header                 = {.Size = sizeof(USB_HID_Descriptor_HID_t), .Type = HID_DTYPE_HID}, \
+				.HIDSpec                = VERSION_BCD(1,1,1),                                            \
+				.CountryCode            = 0x00,                                                          \
+				.TotalReportDescriptors = 1,                                                             \
+				.HIDReportType          = HID_DTYPE_Report,                                              \
+				.HIDReportLength        = sizeof(JoystickReport)                                         \
+			},                                                                                           \
+		.ReportINEndpoint =                                                                              \
+			{                                                                                            \
+				.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint}, \
+				.EndpointAddress        = JOYSTICK_EPADDR(Index),                                        \
+				.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA), \
+				.EndpointSize           = JOYSTICK_EPSIZE,                                               \
+				.PollingIntervalMS      = JOYSTICK_POLLING_INTERVAL_MS                                   \
+			},                                                                                           \
+	},
+
+
 /** Configuration descriptor structure. This descriptor, located in FLASH memory, describes the usage
  *  of the device in one of its supported configurations, including information about any device interfaces
  *  and endpoints. The descriptor is read out by the USB host during the enumeration process when selecting
@@ -360,7 +259,7 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 			.Header                 = {.Size = sizeof(USB_Descriptor_Configuration_Header_t), .Type = DTYPE_Configuration},
 
 			.TotalConfigurationSize = sizeof(USB_Descriptor_Configuration_t),
-			.TotalInterfaces        = 4,
+			.TotalInterfaces        = JOYSTICK_INTERFACE_COUNT,
 
 			.ConfigurationNumber    = 1,
 			.ConfigurationStrIndex  = NO_DESCRIPTOR,
@@ -370,158 +269,8 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
 			.MaxPowerConsumption    = USB_CONFIG_POWER_MA(500)
 		},
 
-		// Joystick HID interface (HID0)
-	.HID0_Interface =
-		{
-			.Header                 = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface},
-
-			.InterfaceNumber        = 0x00, // Interface 0 is joystick 0
-			.AlternateSetting       = 0x00,
-
-			.TotalEndpoints         = 1,
-
-			.Class                  = HID_CSCP_HIDClass,
-			.SubClass               = HID_CSCP_NonBootSubclass,
-			.Protocol               = HID_CSCP_NonBootProtocol,
-
-			.InterfaceStrIndex      = NO_DESCRIPTOR
-		},
-
-	.HID0_JoystickHID =
-		{
-			.Header                 = {.Size = sizeof(USB_HID_Descriptor_HID_t), .Type = HID_DTYPE_HID},
-
-			.HIDSpec                = VERSION_BCD(1,1,1),
-			.CountryCode            = 0x00,
-			.TotalReportDescriptors = 1,
-			.HIDReportType          = HID_DTYPE_Report,
-			.HIDReportLength        = sizeof(JoystickReport0)
-		},
-
-	.HID0_ReportINEndpoint =
-		{
-			.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
-
-			.EndpointAddress        = JOYSTICK0_EPADDR,
-			.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
-			.EndpointSize           = JOYSTICK_EPSIZE,
-			.PollingIntervalMS      = 0x05
-		},
-		
-	// Joystick HID interface (HID1)
-	.HID1_Interface =
-		{
-			.Header                 = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface},
-
-			.InterfaceNumber        = 0x01, // Interface 1 is joystick 1
-			.AlternateSetting       = 0x00,
-
-			.TotalEndpoints         = 1,
-
-			.Class                  = HID_CSCP_HIDClass,
-			.SubClass               = HID_CSCP_NonBootSubclass,
-			.Protocol               = HID_CSCP_NonBootProtocol,
-
-			.InterfaceStrIndex      = NO_DESCRIPTOR
-		},
-
-	.HID1_JoystickHID =
-		{
-		.Header                 = {.Size = sizeof(USB_HID_Descriptor_HID_t), .Type = HID_DTYPE_HID},
-
-		.HIDSpec                = VERSION_BCD(1,1,1),
-		.CountryCode            = 0x00,
-		.TotalReportDescriptors = 1,
-		.HIDReportType          = HID_DTYPE_Report,
-		.HIDReportLength        = sizeof(JoystickReport1)
-		},
-
-	.HID1_ReportINEndpoint =
-		{
-			.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
-
-			.EndpointAddress        = JOYSTICK1_EPADDR,
-			.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
-			.EndpointSize           = JOYSTICK_EPSIZE,
-			.PollingIntervalMS      = 0x05
-		},
-		
-	// Joystick HID interface (HID2)
-	.HID2_Interface =
-		{
-			.Header                 = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface},
-
-			.InterfaceNumber        = 0x02, // Interface 2 is joystick 2
-			.AlternateSetting       = 0x00,
-
-			.TotalEndpoints         = 1,
-
-			.Class                  = HID_CSCP_HIDClass,
-			.SubClass               = HID_CSCP_NonBootSubclass,
-			.Protocol               = HID_CSCP_NonBootProtocol,
-
-			.InterfaceStrIndex      = NO_DESCRIPTOR
-		},
-
-	.HID2_JoystickHID =
-		{
-			.Header                 = {.Size = sizeof(USB_HID_Descriptor_HID_t), .Type = HID_DTYPE_HID},
-
-			.HIDSpec                = VERSION_BCD(1,1,1),
-			.CountryCode            = 0x00,
-			.TotalReportDescriptors = 1,
-			.HIDReportType          = HID_DTYPE_Report,
-			.HIDReportLength        = sizeof(JoystickReport1)
-		},
-
-	.HID2_ReportINEndpoint =
-		{
-			.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
-
-			.EndpointAddress        = JOYSTICK2_EPADDR,
-			.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
-			.EndpointSize           = JOYSTICK_EPSIZE,
-			.PollingIntervalMS      = 0x05
-		},
-		
-	// Joystick HID interface (HID3)
-	.HID3_Interface =
-		{
-			.Header                 = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface},
-
-			.InterfaceNumber        = 0x03, // Interface 2 is joystick 2
-			.AlternateSetting       = 0x00,
-
-			.TotalEndpoints         = 1,
-
-			.Class                  = HID_CSCP_HIDClass,
-			.SubClass               = HID_CSCP_NonBootSubclass,
-			.Protocol               = HID_CSCP_NonBootProtocol,
-
-			.InterfaceStrIndex      = NO_DESCRIPTOR
-		},
-
-	.HID3_JoystickHID =
-		{
-			.Header                 = {.Size = sizeof(USB_HID_Descriptor_HID_t), .Type = HID_DTYPE_HID},
-
-			.HIDSpec                = VERSION_BCD(1,1,1),
-			.CountryCode            = 0x00,
-			.TotalReportDescriptors = 1,
-			.HIDReportType          = HID_DTYPE_Report,
-			.HIDReportLength        = sizeof(JoystickReport1)
-		},
-
-	.HID3_ReportINEndpoint =
-		{
-			.Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
-
-			.EndpointAddress        = JOYSTICK3_EPADDR,
-			.Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
-			.EndpointSize           = JOYSTICK_EPSIZE,
-			.PollingIntervalMS      = 0x05
-		},
-	
+	// Joystick HID interfaces (HID0 onwards)
+	.HID = {JOYSTICK_ENTRIES(JOYSTICK_INTERFACE_COUNT, JOYSTICK_DESCRIPTORS)}
 };
 
 /** Language descriptor structure. This descriptor, located in FLASH memory, is returned when the host requests
@@ -587,54 +336,20 @@ uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
 
 			break;
 		case DTYPE_HID:
-			switch (wIndex)
+			if (wIndex < JOYSTICK_INTERFACE_COUNT)
 			{
-				case 0x00:
-					Address = &ConfigurationDescriptor.HID0_JoystickHID;
-					Size    = sizeof(USB_HID_Descriptor_HID_t);
-					break;
-
-				case 0x01:
-					Address = &ConfigurationDescriptor.HID1_JoystickHID;
-					Size    = sizeof(USB_HID_Descriptor_HID_t);
-					break;
-				case 0x02:
-					Address = &ConfigurationDescriptor.HID2_JoystickHID;
-					Size    = sizeof(USB_HID_Descriptor_HID_t);
-					break;
-
-				case 0x03:
-					Address = &ConfigurationDescriptor.HID3_JoystickHID;
-					Size    = sizeof(USB_HID_Descriptor_HID_t);
-					break;
-			
+				Address = &ConfigurationDescriptor.HID[wIndex].JoystickHID;
+				Size    = sizeof(USB_HID_Descriptor_HID_t);
 			}
+
 			break;
 		case DTYPE_Report:
-			switch (wIndex)
+			if (wIndex < JOYSTICK_INTERFACE_COUNT)
 			{
-				case 0x00:
-					Address = &JoystickReport0;
-					Size    = sizeof(JoystickReport0);
-					break;
-
-				case 0x01:
-					Address = &JoystickReport1;
-					Size    = sizeof(JoystickReport1);
-					break;
-				
-				case 0x02:
-					Address = &JoystickReport2;
-					Size    = sizeof(JoystickReport2);
-					break;
+				Address = &JoystickReport;
+				Size    = sizeof(JoystickReport);
+			}
 
-				case 0x03:
-					Address = &JoystickReport3;
-					Size    = sizeof(JoystickReport3);
-					break;
-				
-				
-			}				
 			break;
 	}
 
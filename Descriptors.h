@@ -41,7 +41,64 @@
 
 		#include <avr/pgmspace.h>
 
+		#include "Lib/HAL.h"
+
+	/* Macros: */
+		#if !defined(JOYSTICK_PAD_COUNT)
+			/** Number of joysticks presented to the host, each as its own HID interface. Set by \c PAD_COUNT in
+			 *  the makefile to build 1, 2 or 3 port units from the same source.
+			 */
+			#define JOYSTICK_PAD_COUNT        4
+		#endif
+
+		// Every joystick is read from its own SNES port
+		#if ((JOYSTICK_PAD_COUNT < 1) || (JOYSTICK_PAD_COUNT > HAL_SNES_PORTS))
+			#error JOYSTICK_PAD_COUNT must be between 1 and the number of SNES ports on the board.
+		#endif
+
+		#if defined(JOYSTICK_MULTIPLEXED)
+			/** Number of joystick HID interfaces. With \c JOYSTICK_MULTIPLEXED defined (\c MULTIPLEXED=1 in the
+			 *  makefile) every pad shares a single interface and IN endpoint, and each report carries all pads.
+			 */
+			#define JOYSTICK_INTERFACE_COUNT  1
+
+			/** Interface (and so endpoint) carrying the reports of the given pad. */
+			#define JOYSTICK_INTERFACE(Pad)   0
+		#else
+			#define JOYSTICK_INTERFACE_COUNT  JOYSTICK_PAD_COUNT
+			#define JOYSTICK_INTERFACE(Pad)   (Pad)
+		#endif
+
+		/** Layout of the input report described by \c JoystickReport in Descriptors.c, in report items. The
+		 *  application checks its report structure against \ref JOYSTICK_REPORT_INPUT_BITS.
+		 */
+		#define JOYSTICK_REPORT_BUTTONS         16
+		#define JOYSTICK_REPORT_HAT_BITS        4
+		#define JOYSTICK_REPORT_HAT_PAD_BITS    JOYSTICK_REPORT_HAT_BITS /* Padding nibble reuses the HAT's report size */
+		#define JOYSTICK_REPORT_AXES            4
+		#define JOYSTICK_REPORT_VENDOR_BYTES    1
+		#define JOYSTICK_REPORT_INPUT_BITS      (JOYSTICK_REPORT_BUTTONS + JOYSTICK_REPORT_HAT_BITS + \
+		                                         JOYSTICK_REPORT_HAT_PAD_BITS + (JOYSTICK_REPORT_AXES * 8) + \
+		                                         (JOYSTICK_REPORT_VENDOR_BYTES * 8))
+
+		/** Size in bytes of one input report sent to the host, which holds every pad on the interface. */
+		#if defined(JOYSTICK_MULTIPLEXED)
+			#define JOYSTICK_REPORT_INPUT_BYTES     ((JOYSTICK_REPORT_INPUT_BITS / 8) * JOYSTICK_PAD_COUNT)
+		#else
+			#define JOYSTICK_REPORT_INPUT_BYTES     (JOYSTICK_REPORT_INPUT_BITS / 8)
+		#endif
+
 	/* Type Defines: */
+		/** Type define for the descriptors of one joystick: its HID interface, the HID class descriptor and
+		 *  the report IN endpoint. The configuration descriptor carries one of these per pad.
+		 */
+		typedef struct
+		{
+			USB_Descriptor_Interface_t            Interface;
+			USB_HID_Descriptor_HID_t              JoystickHID;
+			USB_Descriptor_Endpoint_t             ReportINEndpoint;
+		} ATTR_PACKED USB_Descriptor_Joystick_t;
+
 		/** Type define for the device configuration descriptor structure. This must be defined in the
 		 *  application code, as the configuration descriptor contains several sub-descriptors which
 		 *  vary between devices, and which describe the device's usage to the host.
@@ -50,24 +107,8 @@
 		{
 			USB_Descriptor_Configuration_Header_t Config;
 
-			// Joystick HID Interface
-			
-			
-			USB_Descriptor_Interface_t            HID0_Interface;
-			USB_HID_Descriptor_HID_t              HID0_JoystickHID;
-			USB_Descriptor_Endpoint_t             HID0_ReportINEndpoint;
-				
-			USB_Descriptor_Interface_t            HID1_Interface;
-			USB_HID_Descriptor_HID_t              HID1_JoystickHID;
-			USB_Descriptor_Endpoint_t             HID1_ReportINEndpoint;
-			
-			USB_Descriptor_Interface_t            HID2_Interface;
-			USB_HID_Descriptor_HID_t              HID2_JoystickHID;
-			USB_Descriptor_Endpoint_t             HID2_ReportINEndpoint;
-			
-			USB_Descriptor_Interface_t            HID3_Interface;
-			USB_HID_Descriptor_HID_t              HID3_JoystickHID;
-			USB_Descriptor_Endpoint_t             HID3_ReportINEndpoint;
+			// Joystick HID Interfaces, interface n and endpoint n + 1 belong to pad n (or all pads when multiplexed)
+			USB_Descriptor_Joystick_t             HID[JOYSTICK_INTERFACE_COUNT];
 		} USB_Descriptor_Configuration_t;
 
 		
@@ -91,20 +132,30 @@
 		};
 
 	/* Macros: */
-		/** Endpoint address of the Joystick HID reporting IN endpoint. */
-		
-		
-		// Endpoint address of the Joystick HID reporting IN endpoint for 4 joysticks.
-		#define JOYSTICK0_EPADDR           (ENDPOINT_DIR_IN | 1)
-		#define JOYSTICK1_EPADDR           (ENDPOINT_DIR_IN | 2)
-		#define JOYSTICK2_EPADDR           (ENDPOINT_DIR_IN | 3)
-		#define JOYSTICK3_EPADDR           (ENDPOINT_DIR_IN | 4)
+		/** Endpoint address of the Joystick HID reporting IN endpoint of the given interface. */
+		#define JOYSTICK_EPADDR(Interface)  (ENDPOINT_DIR_IN | ((Interface) + 1))
 		
 		/** Size in bytes of the Joystick HID reporting IN endpoint. */
 		// The Switch -needs- this to be 64.
 		// The Wii U is flexible, allowing us to use the default of 8 (which did not match the original Hori descriptors).
 		#define JOYSTICK_EPSIZE           64
 
+		#if (JOYSTICK_REPORT_INPUT_BYTES > JOYSTICK_EPSIZE)
+			#error The input report does not fit in one JOYSTICK_EPSIZE packet.
+		#endif
+
+		#if !defined(JOYSTICK_POLLING_INTERVAL_MS)
+			/** Polling interval of the joystick IN endpoints in milliseconds, set by \c POLLING_INTERVAL_MS in the
+			 *  makefile. Profiles of 1, 2, 4 and 5ms are supported.
+			 */
+			#define JOYSTICK_POLLING_INTERVAL_MS  5
+		#endif
+
+		#if ((JOYSTICK_POLLING_INTERVAL_MS != 1) && (JOYSTICK_POLLING_INTERVAL_MS != 2) && \
+		     (JOYSTICK_POLLING_INTERVAL_MS != 4) && (JOYSTICK_POLLING_INTERVAL_MS != 5))
+			#error JOYSTICK_POLLING_INTERVAL_MS must be 1, 2, 4 or 5.
+		#endif
+
 		/** Descriptor header type value, to indicate a HID class HID descriptor. */
 		#define DTYPE_HID                 0x21
 
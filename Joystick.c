@@ -35,26 +35,57 @@
  */
 
 #include "Joystick.h"
-// Array for storing the physical button state, de-bounce counter and current de-bounced button state
+// Packed state of each joystick, see struct joystickState in Joystick.h
+struct joystickState joyStick[JOYSTICK_PAD_COUNT];
 
-struct buttonState
+// Timer tick of the last de-bounce step, see elapsedDebounceSteps()
+static uint16_t debounceStepTime;
+
+// Double buffer of published snapshots, see struct joystickSnapshot in Joystick.h. Snapshot n of the
+// sequence is written to snapshots[n & 1], and the sequence number is bumped once it is complete.
+static volatile struct joystickSnapshot snapshots[2];
+static volatile uint8_t snapshotSequence;
+
+// Queue of de-bounced state changes of each joystick, see struct joystickEvent in Joystick.h. Events are
+// written by performDebounce() at eventHead and read by consumeEvents() at eventTail. Each side only
+// writes its own index, with a single byte store once the event is complete or copied, so neither has to
+// disable interrupts. The indices run freely, the queue holding (eventHead - eventTail) events.
+static volatile struct joystickEvent events[JOYSTICK_PAD_COUNT][JOYSTICK_EVENT_QUEUE];
+static volatile uint8_t eventHead[JOYSTICK_PAD_COUNT];
+static volatile uint8_t eventTail[JOYSTICK_PAD_COUNT];
+
+// Report side bookkeeping of each joystick, only touched by the USB side
+struct joystickReportState
 {
-	uint8_t physicalState; // On or off
-	uint8_t state; // On or off
-	uint8_t debounceCount;
+	uint16_t state; // State the live report was last built from, see reportedState()
+	uint16_t committedState; // State the last report committed to the interrupt endpoint was built from
+	uint16_t latched; // Buttons whose de-bounced state differed from committedState in some event since
+	uint16_t edgeTime; // Time of the oldest event not yet carried by a committed report, for the latency
+	bool edgePending; // Such an event was consumed
+	bool changed; // Live report changed since it was last sent on the interrupt endpoint
 };
 
-// Array for storing the physical state of all four joysticks
-struct joystickState
-{
-	struct buttonState button[NUMBER_OF_BUTTONS];
-} joyStick[4];
+static struct joystickReportState reportStates[JOYSTICK_PAD_COUNT];
 
-// Global for storing the previously sent reports for each joystick
-USB_JoystickReport_Input_t previousJoystickReportData0;
-USB_JoystickReport_Input_t previousJoystickReportData1;
-USB_JoystickReport_Input_t previousJoystickReportData2;
-USB_JoystickReport_Input_t previousJoystickReportData3;
+// Latest snapshot read by HID_Task(), and its sequence number
+static struct joystickSnapshot inputSnapshot;
+static uint8_t inputSequence;
+
+// Live HID report of each joystick, patched by GetNextReport() only when the de-bounced state changes
+// and streamed to the endpoints straight from here. HID_Task() only patches a report right before
+// committing it, so these are also the last committed reports, as served to GET_REPORT. Back to back,
+// the reports are the report of the multiplexed interface. Every report starts out as the one for
+// nothing held.
+USB_JoystickReport_Input_t joystickReports[JOYSTICK_PAD_COUNT] =
+	{
+		[0 ... (JOYSTICK_PAD_COUNT - 1)] = { .Button = 0, .HAT = 0xFF, .X = 128, .Y = 128, .Slider = 128, .Z = 128 },
+	};
+
+// HID idle rate of each interface in 4ms units as set by the host (reset to JOYSTICK_DEFAULT_IDLE
+// when the device is configured), and the USB frame number at which each interface last sent a
+// report, for the keepalive refresh
+uint8_t idleRate[JOYSTICK_INTERFACE_COUNT];
+uint16_t lastReportFrame[JOYSTICK_INTERFACE_COUNT];
 
 /*** Button Mappings ****
 The Pokken controller exposes 13 buttons, of which only 10 have physical
@@ -96,35 +127,88 @@ Down, Left and Right as specific buttons instead of a 'directional unit').
 #define POKKEN_BURST   (PAD_L | PAD_R)
 
 /*
-The following ButtonMap variable defines all possible buttons within the
-original 13 bits of space, along with attempting to investigate the remaining
-3 bits that are 'unused'. This is what led to finding that the 'Capture'
-button was operational on the stick.
+The SNES to Switch mapping is resolved at compile time into flash lookup tables
+indexed by one nibble of the packed (de-bounced) SNES state word, so building a
+report is three button lookups and one D-pad lookup with no branches. Change the
+mapping here; the tables below are generated from it.
 */
-uint16_t ButtonMap[16] = {
-	0x01,
-	0x02,
-	0x04,
-	0x08,
-	0x10,
-	0x20,
-	0x40,
-	0x80,
-	0x100,
-	0x200,
-	0x400,
-	0x800,
-	0x1000,
-	0x2000,
-	0x4000,
-	0x8000,
+#define SNES_TO_SWITCH_BUTTON(bit)               \
+	(((bit) == MAP_FIREB_BUTTON)  ? PAD_B      : \
+	 ((bit) == MAP_FIREY_BUTTON)  ? PAD_Y      : \
+	 ((bit) == MAP_SELECT_BUTTON) ? PAD_HOME   : \
+	 ((bit) == MAP_START_BUTTON)  ? PAD_START  : \
+	 ((bit) == MAP_FIREA_BUTTON)  ? PAD_A      : \
+	 ((bit) == MAP_FIREX_BUTTON)  ? PAD_X      : \
+	 ((bit) == MAP_FIREL_BUTTON)  ? PAD_L      : \
+	 ((bit) == MAP_FIRER_BUTTON)  ? PAD_R      : 0)
+
+// The D-pad must sit in a single nibble of the state word so it resolves with one lookup
+#define DPAD_NIBBLE (MAP_UP_BUTTON / 4)
+
+#if ((MAP_DOWN_BUTTON / 4) != DPAD_NIBBLE) || ((MAP_LEFT_BUTTON / 4) != DPAD_NIBBLE) || ((MAP_RIGHT_BUTTON / 4) != DPAD_NIBBLE)
+	#error The D-pad buttons must all map to the same nibble of the state word.
+#endif
+
+// Expands ENTRY(nibble, value) for every value a nibble can take
+#define NIBBLE_TABLE(ENTRY, nibble)                                                         \
+	{ ENTRY(nibble, 0),  ENTRY(nibble, 1),  ENTRY(nibble, 2),  ENTRY(nibble, 3),            \
+	  ENTRY(nibble, 4),  ENTRY(nibble, 5),  ENTRY(nibble, 6),  ENTRY(nibble, 7),            \
+	  ENTRY(nibble, 8),  ENTRY(nibble, 9),  ENTRY(nibble, 10), ENTRY(nibble, 11),           \
+	  ENTRY(nibble, 12), ENTRY(nibble, 13), ENTRY(nibble, 14), ENTRY(nibble, 15) }
+
+// Switch buttons held when the given nibble of the state word has the given value
+#define BUTTON_MAP_ENTRY(nibble, value)                                           \
+	((((value) & 1) ? SNES_TO_SWITCH_BUTTON(((nibble) * 4) + 0) : 0) |        \
+	 (((value) & 2) ? SNES_TO_SWITCH_BUTTON(((nibble) * 4) + 1) : 0) |        \
+	 (((value) & 4) ? SNES_TO_SWITCH_BUTTON(((nibble) * 4) + 2) : 0) |        \
+	 (((value) & 8) ? SNES_TO_SWITCH_BUTTON(((nibble) * 4) + 3) : 0))
+
+// D-pad directions as -1, 0 or 1 for a D-pad nibble value; up and left win over down and right
+#define DPAD_HELD(value, map)	((value) & (1 << ((map) - (DPAD_NIBBLE * 4))))
+#define DPAD_X(value)	(DPAD_HELD(value, MAP_LEFT_BUTTON) ? -1 : DPAD_HELD(value, MAP_RIGHT_BUTTON) ? 1 : 0)
+#define DPAD_Y(value)	(DPAD_HELD(value, MAP_UP_BUTTON)   ? -1 : DPAD_HELD(value, MAP_DOWN_BUTTON)  ? 1 : 0)
+
+// HAT switch position (0 = north, clockwise in 45 degree steps), or 0xFF when centred
+#define DPAD_HAT(value)                                                                            \
+	((DPAD_Y(value) < 0) ? ((DPAD_X(value) < 0) ? 7 : (DPAD_X(value) > 0) ? 1 : 0) :               \
+	 (DPAD_Y(value) > 0) ? ((DPAD_X(value) < 0) ? 5 : (DPAD_X(value) > 0) ? 3 : 4) :               \
+	                       ((DPAD_X(value) < 0) ? 6 : (DPAD_X(value) > 0) ? 2 : 0xFF))
+
+// Report fields for a D-pad nibble value. By default the D-pad drives the left stick and the HAT
+// stays centred; define DPAD_AS_HAT to report it on the HAT with the stick centred instead.
+#if defined(DPAD_AS_HAT)
+	#define DIRECTION_MAP_ENTRY(nibble, value) \
+		{ .HAT = DPAD_HAT(value), .X = 128, .Y = 128 }
+#else
+	#define DIRECTION_MAP_ENTRY(nibble, value) \
+		{ .HAT = 0xFF, .X = (128 + (DPAD_X(value) * 128) - (DPAD_X(value) > 0)), .Y = (128 + (DPAD_Y(value) * 128) - (DPAD_Y(value) > 0)) }
+#endif
+
+typedef struct
+{
+	uint8_t HAT;
+	uint8_t X;
+	uint8_t Y;
+} directionMapEntry;
+
+// Switch buttons for each nibble of the packed state word
+static const uint16_t ButtonMap[3][16] PROGMEM =
+{
+	NIBBLE_TABLE(BUTTON_MAP_ENTRY, 0),
+	NIBBLE_TABLE(BUTTON_MAP_ENTRY, 1),
+	NIBBLE_TABLE(BUTTON_MAP_ENTRY, 2),
 };
 
+// HAT and stick position for each value of the D-pad nibble
+static const directionMapEntry DirectionMap[16] PROGMEM = NIBBLE_TABLE(DIRECTION_MAP_ENTRY, DPAD_NIBBLE);
 
 
 
+
+#if !defined(SIMULATOR)
 /** Main program entry point. This routine configures the hardware required by the application, then
- *  enters a loop to run the application tasks in sequence.
+ *  enters a loop to run the application tasks in sequence. The simulator (Sim/SimMain.c) provides its
+ *  own entry point that drives the same tasks against simulated hardware.
  */
 int main(void)
 {
@@ -133,131 +217,465 @@ int main(void)
 
 	while (1)
 	{
-		readJoystickStates();
-		// Perform button and joystick debouncing
-		performDebounce();
+		// Perform button and joystick debouncing once per completed shift
+		HAL_Bench_Mark(BENCH_STAGE_Read);
+		if (readJoystickStates())
+		{
+			HAL_Bench_Mark(BENCH_STAGE_Debounce);
+			performDebounce();
+		}
 		
+		HAL_Bench_Mark(BENCH_STAGE_HIDTask);
 		HID_Task();
+		HAL_Bench_Mark(BENCH_STAGE_USBTask);
 		USB_USBTask();
 		
 	}
 }
+#endif
 
 /** Configures the board hardware and chip peripherals for the demo's functionality. */
 void SetupHardware(void)
 {
-	/* Disable watchdog if enabled by bootloader/fuses */
-	MCUSR &= ~(1 << WDRF);
-	wdt_disable();
+	/* Disable watchdog and clock division left over from the bootloader */
+	HAL_Init();
+
+	/* SNES port data, clock and latch lines */
+	HAL_SNES_Init();
+
+	/* Free-running timestamp timer */
+	HAL_Timer_Init();
 
-	/* Disable clock division */
-	clock_prescale_set(clock_div_1);
+#if (SNES_SHIFT_MODE != SNES_SHIFT_MODE_BLOCKING)
+	/* Begin the first frame, picked up by the main loop once it has been shifted in */
+	SNESShift_Start();
+#endif
 	
-	DDRD  &= ~0xFF;
-	PORTD |=  0xFF;
+	/* Hardware Initialization */
+	USB_Init();
+
+#if defined(BENCHMARK)
+	/* The benchmark has no USB host, and instead reports every IN endpoint as ready (see Bench/Bench.c) */
+	USB_DeviceState = DEVICE_STATE_Configured;
+#endif
+}
 
+// Set when a port is re-classified, so that the shift clock is calibrated again for the pads now plugged in
+static bool calibrationPending;
+
+// Classify what is plugged into a port from the last frame. The type only changes once the new
+// classification has held for PRESENCE_FRAMES frames; a pad that is pulled out drops its buttons at
+// once, which leaves one all-released report for the USB side to send.
+static void classifyPort(struct joystickState* const joystick, const uint16_t pressedState, const bool present)
+{
+	uint8_t type;
 	
+	if (!present)
+		type = JOYSTICK_TYPE_EMPTY;
+	else if (pressedState & ID_MASK)
+		type = JOYSTICK_TYPE_OTHER;
+	else
+		type = JOYSTICK_TYPE_PAD;
 	
-	//data 3 
-	DDRB  &= ~((1 << 2));
-	PORTB |=  (1 << 2);
-	//data 2 
-	DDRB  &= ~((1 << 5));
-	PORTB |=  (1 << 5);
-	//data 1 
-	DDRF  &= ~((1 << 4));
-	PORTF |=  (1 << 4);
-	//data 0
-	DDRF  &= ~((1 << 5));
-	PORTF |=  (1 << 5);
+	if (type == joystick->type)
+	{
+		joystick->candidateFrames = 0;
+		return;
+	}
 	
-	// clock 
-	DDRF  |= (1 << 7);
-	PORTF &= ~((1 << 7));
+	if (type != joystick->candidateType)
+	{
+		joystick->candidateType = type;
+		joystick->candidateFrames = 0;
+	}
 	
-	//latch
-	DDRF  |= (1 << 6);
-	PORTF &= ~((1 << 6));
+	if (++joystick->candidateFrames < PRESENCE_FRAMES)
+		return;
 	
+	if (joystick->type == JOYSTICK_TYPE_PAD)
+	{
+		joystick->state = 0;
+		joystick->debouncePending = 0;
+		joystick->debounceLocked = 0;
+	}
 	
+	joystick->type = type;
+	joystick->candidateFrames = 0;
 	
-	/* Hardware Initialization */
-	USB_Init();
+	calibrationPending = true;
 }
 
-// Read the joystick button states for all 4 joysticks
-void readJoystickStates(void)
+// Store a freshly read frame as the physical state of all joysticks, and classify each port. Also used
+// by the trace replay (Sim/TraceReplay.c) to feed recorded frames into the pipeline.
+void storePhysicalStates(const uint16_t* const pressedStates, const uint8_t presentPorts)
 {
-// Set joystick latch low
-	PORTF &= ~(1 << 6);
+	const uint16_t now = HAL_Timer_Read();
+	
+	Measurement_FrameRead();
 	
-	for (uint16_t buttonNumber = 0; buttonNumber < NUMBER_OF_BUTTONS; buttonNumber++)
+	for (uint8_t joystickNumber = 0; joystickNumber < JOYSTICK_PAD_COUNT; joystickNumber++)
 	{
-		// Set joystick clock low
-		_delay_us(6);
-		PORTF &= ~(1 << 7);
+		struct joystickState* const joystick = &joyStick[joystickNumber];
+		const bool present = (presentPorts & (1 << joystickNumber));
 		
-		// Read the data pin state for all joysticks
-		if (!(PINF & (1 << 5))) joyStick[0].button[buttonNumber].physicalState = BUTTON_OFF;
-		else joyStick[0].button[buttonNumber].physicalState = BUTTON_ON;
+		classifyPort(joystick, pressedStates[joystickNumber], present);
 		
-		if (!(PINF & (1 << 4))) joyStick[1].button[buttonNumber].physicalState = BUTTON_OFF;
-		else joyStick[1].button[buttonNumber].physicalState = BUTTON_ON;
+		// Time edges from the first frame in which the input disagrees with the de-bounced state, starting
+		// over when it bounces back before being accepted
+		if ((joystick->type != JOYSTICK_TYPE_PAD) || ((pressedStates[joystickNumber] & BUTTON_MASK) == joystick->state))
+		{
+			joystick->inputDiffers = false;
+		}
+		else if (!joystick->inputDiffers)
+		{
+			joystick->inputDiffers = true;
+			joystick->inputTime = now;
+		}
 		
-		if (!(PINB & (1 << 5))) joyStick[2].button[buttonNumber].physicalState = BUTTON_OFF;
-		else joyStick[2].button[buttonNumber].physicalState = BUTTON_ON;
+		joystick->physicalState = pressedStates[joystickNumber];
+	}
+}
+
+// True once no port has a pad, or is about to be classified as one
+static bool portsIdle(void)
+{
+	for (uint8_t joystickNumber = 0; joystickNumber < JOYSTICK_PAD_COUNT; joystickNumber++)
+	{
+		if ((joyStick[joystickNumber].type == JOYSTICK_TYPE_PAD) || joyStick[joystickNumber].candidateFrames)
+			return false;
+	}
+	
+	return true;
+}
+
+#if (SNES_SHIFT_MODE != SNES_SHIFT_MODE_BLOCKING)
+// Set while the frame being shifted in is one at the slowest bit period
+static bool slowFrame;
+
+// Start shifting in the next frame, at the slowest bit period once every PROBE_INTERVAL_MS
+static void startFrame(void)
+{
+	static uint16_t lastSlowFrameTime;
+	const uint16_t now = HAL_Timer_Read();
+	
+	slowFrame = ((uint16_t)(now - lastSlowFrameTime) >= PROBE_INTERVAL_TICKS);
+	
+	if (slowFrame)
+	{
+		lastSlowFrameTime = now;
+		SNESShift_StartSlow();
+	}
+	else
+	{
+		SNESShift_Start();
+	}
+}
+
+// Ports with something plugged in, as classified, bit n for port n
+static uint8_t occupiedPorts(void)
+{
+	uint8_t ports = 0;
+	
+	for (uint8_t joystickNumber = 0; joystickNumber < JOYSTICK_PAD_COUNT; joystickNumber++)
+	{
+		if (joyStick[joystickNumber].type != JOYSTICK_TYPE_EMPTY)
+			ports |= (1 << joystickNumber);
+	}
+	
+	return ports;
+}
+#endif
+
+// Read the joystick button states for all 4 joysticks, returning true if new states were read. While
+// no pad is connected, the ports are only probed every PROBE_INTERVAL_MS. Otherwise one frame in every
+// PROBE_INTERVAL_MS is shifted at the slowest bit period, to spot a pad plugged in on a cable too long
+// for the calibrated one. With SOF_SCHEDULE, a frame that would still be shifting in when the pipeline
+// ahead of the host's next poll should start is held back, so that one is latched PIPELINE_BUDGET_US
+// before the poll.
+bool readJoystickStates(void)
+{
+	static bool probeWait;
+	static uint16_t lastProbeTime;
+#if (SNES_SHIFT_MODE != SNES_SHIFT_MODE_BLOCKING)
+	static bool shiftWait;
+#endif
+	
+	uint16_t pressedStates[HAL_SNES_PORTS] = {0, 0, 0, 0};
+	uint8_t presentPorts = 0;
+	
+	if (probeWait)
+	{
+		if ((uint16_t)(HAL_Timer_Read() - lastProbeTime) < PROBE_INTERVAL_TICKS)
+			return false;
 		
-		if (!(PINB & (1 << 2))) joyStick[3].button[buttonNumber].physicalState = BUTTON_OFF;
-		else joyStick[3].button[buttonNumber].physicalState = BUTTON_ON;
+		probeWait = false;
 		
+#if (SNES_SHIFT_MODE != SNES_SHIFT_MODE_BLOCKING)
+		// The probe frame is picked up on a later pass, once shifted in. It is slow as well, but a pad
+		// it finds is calibrated for once classified.
+		slowFrame = false;
+		SNESShift_StartSlow();
+		return false;
+#endif
+	}
+	
+#if (SNES_SHIFT_MODE != SNES_SHIFT_MODE_BLOCKING)
+	// Start the frame held back for the host's poll phase once its time comes, and pick it up on a later pass
+	if (shiftWait)
+	{
+		if (!PollSchedule_IsShiftTime(PIPELINE_BUDGET_US, SNES_FRAME_US))
+			return false;
+		
+		shiftWait = false;
+		startFrame();
+		return false;
+	}
+	
+	// Pick up the last frame from the shift engine, if it has finished
+	if (!SNESShift_GetFrame(pressedStates, &presentPorts))
+		return false;
+#else
+	if (!PollSchedule_IsShiftTime(PIPELINE_BUDGET_US, SNES_FRAME_US))
+		return false;
+	
+	// Set joystick latch low
+	HAL_SNES_LatchLow();
+	
+	for (uint8_t bit = 0; bit < SNES_DATA_BITS; bit++)
+	{
+		// Set joystick clock low
+		HAL_DelayUS(6);
+		HAL_SNES_ClockLow();
 		
+		// Sample the data lines of all joysticks at once, a held button pulls its data line low
+		SNESShift_ShiftIn(pressedStates, HAL_SNES_ReadLines());
 		
 		// Set joystick clock high
-		_delay_us(6);
-		PORTF |= (1 << 7);
+		HAL_DelayUS(6);
+		HAL_SNES_ClockHigh();
 	}
 	
+	// Past the ID bits a pad shifts out its grounded serial input, while an empty port stays high
+	HAL_DelayUS(6);
+	HAL_SNES_ClockLow();
+	
+	presentPorts = HAL_SNES_ReadLines();
+	
+	HAL_DelayUS(6);
+	HAL_SNES_ClockHigh();
+	
 	// Set joystick latch high
-	PORTF |= (1 << 6);
+	HAL_SNES_LatchHigh();
+#endif
 	
-	//end	
+	storePhysicalStates(pressedStates, presentPorts);
 	
+#if (SNES_SHIFT_MODE != SNES_SHIFT_MODE_BLOCKING)
+	// A port that only shows up at the slowest bit period has a pad on a long cable behind it
+	if (slowFrame && (presentPorts & JOYSTICK_PORT_MASK & ~occupiedPorts()))
+		calibrationPending = true;
+	
+	// Time the shift clock for the pads now plugged in, while no frame is in progress
+	if (calibrationPending)
+	{
+		calibrationPending = false;
+		SNESShift_Calibrate(JOYSTICK_PORT_MASK);
+	}
+#endif
+	
+	if (portsIdle())
+	{
+		probeWait = true;
+		lastProbeTime = HAL_Timer_Read();
+	}
+#if (SNES_SHIFT_MODE != SNES_SHIFT_MODE_BLOCKING)
+	else if (PollSchedule_IsShiftTime(PIPELINE_BUDGET_US, SNES_FRAME_US))
+	{
+		startFrame();
+	}
+	else
+	{
+		shiftWait = true;
+	}
+#endif
+	
+	return true;
 }
 
-// Debounce buttons and joysticks on and off to improve joystick feedback
+// Publish the de-bounced state and type of every joystick as the next snapshot. It is written to the
+// buffer the reader is not being pointed at, and becomes visible with the single byte store of the new
+// sequence number, so a reader never sees it half written.
+static void publishSnapshot(void)
+{
+	const uint8_t sequence = snapshotSequence + 1;
+	volatile struct joystickSnapshot* const snapshot = &snapshots[sequence & 1];
+	
+	for (uint8_t joystickNumber = 0; joystickNumber < JOYSTICK_PAD_COUNT; joystickNumber++)
+	{
+		snapshot->state[joystickNumber] = joyStick[joystickNumber].state;
+		snapshot->type[joystickNumber] = joyStick[joystickNumber].type;
+	}
+	
+	snapshotSequence = sequence;
+}
+
+// Queue a change of a joystick's de-bounced state for the USB side. A change that finds the queue full is
+// dropped: the USB side still follows the published snapshots, and only misses the states in between.
+static void queueEvent(const uint8_t joystickNumber, const uint16_t time, const uint16_t state)
+{
+	const uint8_t head = eventHead[joystickNumber];
+	
+	if ((uint8_t)(head - eventTail[joystickNumber]) == JOYSTICK_EVENT_QUEUE)
+		return;
+	
+	volatile struct joystickEvent* const event = &events[joystickNumber][head & (JOYSTICK_EVENT_QUEUE - 1)];
+	
+	event->time = time;
+	event->state = state;
+	
+	eventHead[joystickNumber] = head + 1;
+}
+
+// Number of de-bounce steps since the last call, at most DEBOUNCE_TARGET. After a longer stall every
+// pending change is due anyway, so the steps are only brought back in phase with the timer.
+static uint8_t elapsedDebounceSteps(const uint16_t now)
+{
+	uint8_t steps = 0;
+	
+	while (((uint16_t)(now - debounceStepTime) >= DEBOUNCE_STEP_TICKS) && (steps < DEBOUNCE_TARGET))
+	{
+		debounceStepTime += DEBOUNCE_STEP_TICKS;
+		steps++;
+	}
+	
+	if (steps == DEBOUNCE_TARGET)
+		debounceStepTime = now;
+	
+	return steps;
+}
+
+// Add the given number of steps to the vertical counters of the counting buttons, and clear the counters
+// of all others. Plane by plane this is a ripple-carry add of the step count, broadcast to those buttons.
+static void stepDebounceCounters(struct joystickState* const joystick, const uint16_t counting, const uint8_t steps)
+{
+	uint16_t carry = 0;
+	
+	for (uint8_t plane = 0; plane < DEBOUNCE_COUNTER_BITS; plane++)
+	{
+		uint16_t count = joystick->debounceCount[plane] & counting;
+		uint16_t step = (steps & (1 << plane)) ? counting : 0;
+		
+		joystick->debounceCount[plane] = count ^ step ^ carry;
+		carry = (count & step) | (carry & (count ^ step));
+	}
+}
+
+// Buttons whose counter has reached the given target. The target is a constant, so the borrow of the
+// plane by plane subtraction folds down to AND/OR operations.
+static uint16_t debounceCountReached(const struct joystickState* const joystick, const uint8_t target)
+{
+	uint16_t borrow = 0;
+	
+	for (uint8_t plane = 0; plane < DEBOUNCE_COUNTER_BITS; plane++)
+	{
+		if (target & (1 << plane))
+			borrow |= ~joystick->debounceCount[plane];
+		else
+			borrow &= ~joystick->debounceCount[plane];
+	}
+	
+	return ~borrow;
+}
+
+// Debounce buttons and joysticks on and off to improve joystick feedback. A button changes state once
+// its physical state has disagreed with it on every frame for DEBOUNCE_US, counted in DEBOUNCE_STEPS
+// steps of the free-running timer so that the window does not depend on the frame or main loop rate.
+// With DEBOUNCE_EAGER, presses skip the wait and lock the button out for DEBOUNCE_LOCKOUT_US instead,
+// counted on the same counters. This is branch-free, so the cost is the same whatever the number of
+// buttons moving.
 void performDebounce(void)
 {
-	for (uint8_t joystickNumber = 0; joystickNumber < 4; joystickNumber++)
+	const uint16_t now = HAL_Timer_Read();
+	const uint8_t steps = elapsedDebounceSteps(now);
+	
+	for (uint8_t joystickNumber = 0; joystickNumber < JOYSTICK_PAD_COUNT; joystickNumber++)
+	{
+		struct joystickState* const joystick = &joyStick[joystickNumber];
+		
+		// Only standard pads are de-bounced
+		if (joystick->type != JOYSTICK_TYPE_PAD)
+			continue;
+		
+		// Buttons whose physical state disagrees with their de-bounced state
+		uint16_t changed = (joystick->physicalState ^ joystick->state) & BUTTON_MASK;
+		uint16_t accepted = 0;
+		
+		// Buttons that were pending or locked out on the last frame keep counting, all others start afresh
+		const uint16_t pending = joystick->debouncePending & changed;
+		const uint16_t locked = joystick->debounceLocked;
+		
+		stepDebounceCounters(joystick, (pending | locked), steps);
+		
+#if defined(DEBOUNCE_EAGER)
+		// Locked out buttons ignore their input until the lockout has run
+		joystick->debounceLocked &= ~debounceCountReached(joystick, DEBOUNCE_LOCKOUT_TARGET);
+		changed &= ~joystick->debounceLocked;
+		
+		// Accept presses on their first edge, and lock those buttons out
+		accepted = changed & joystick->physicalState;
+		joystick->debounceLocked |= accepted;
+		changed &= ~accepted;
+#endif
+		
+		uint16_t expired = pending & debounceCountReached(joystick, DEBOUNCE_TARGET);
+		
+		joystick->debouncePending = changed & ~expired;
+		accepted |= expired;
+		
+		// Only buttons still pending or locked out from the last frame keep their count
+		const uint16_t counting = (joystick->debouncePending & pending) | (joystick->debounceLocked & locked);
+		
+		for (uint8_t plane = 0; plane < DEBOUNCE_COUNTER_BITS; plane++)
+			joystick->debounceCount[plane] &= counting;
+		
+		// Change state where the window was met
+		joystick->state ^= accepted;
+		
+		// One event for the change, timed from the frame the input started to move, which is then timed
+		// afresh for any buttons still pending
+		if (accepted)
+		{
+			queueEvent(joystickNumber, joystick->inputTime, joystick->state);
+			joystick->inputDiffers = false;
+		}
+	}
+	
+	publishSnapshot();
+}
+
+// Copy the latest published snapshot, returning its sequence number. The copy is retried in the unlikely
+// case that two snapshots were published while it was taken, as only then can the buffer being copied
+// have been rewritten. Safe to call while performDebounce() runs from an interrupt, without disabling
+// interrupts.
+uint8_t readSnapshot(struct joystickSnapshot* const snapshot)
+{
+	uint8_t sequence;
+	
+	do
 	{
-		// De-bounce all buttons on and off
-		for (uint16_t buttonNumber = 0; buttonNumber < NUMBER_OF_BUTTONS; buttonNumber++)
+		sequence = snapshotSequence;
+		
+		const volatile struct joystickSnapshot* const published = &snapshots[sequence & 1];
+		
+		for (uint8_t joystickNumber = 0; joystickNumber < JOYSTICK_PAD_COUNT; joystickNumber++)
 		{
-			// De-bounce on
-			if (joyStick[joystickNumber].button[buttonNumber].physicalState ==
-				BUTTON_ON && joyStick[joystickNumber].button[buttonNumber].state == BUTTON_OFF)
-			{
-				// If the de-bounce tolerance is met change state otherwise
-				// increment the de-bounce counter
-				if (joyStick[joystickNumber].button[buttonNumber].debounceCount > DEBOUNCE_TOLERANCE)
-				joyStick[joystickNumber].button[buttonNumber].state = BUTTON_ON;
-				else joyStick[joystickNumber].button[buttonNumber].debounceCount++;
-			}
-			// De-bounce off
-			if (joyStick[joystickNumber].button[buttonNumber].physicalState
-				== BUTTON_OFF && joyStick[joystickNumber].button[buttonNumber].state == BUTTON_ON)
-			{			
-				// If the de-bounce tolerance is met change state otherwise
-				// increment the de-bounce counter
-				if (joyStick[joystickNumber].button[buttonNumber].debounceCount > DEBOUNCE_TOLERANCE)
-				joyStick[joystickNumber].button[buttonNumber].state = BUTTON_OFF;
-				else joyStick[joystickNumber].button[buttonNumber].debounceCount++;
-			}
-			// Reset de-bounce counter
-			if (joyStick[joystickNumber].button[buttonNumber].physicalState ==
-				joyStick[joystickNumber].button[buttonNumber].state)
-				joyStick[joystickNumber].button[buttonNumber].debounceCount = 0;
+			snapshot->state[joystickNumber] = published->state[joystickNumber];
+			snapshot->type[joystickNumber] = published->type[joystickNumber];
 		}
-	}		
+	}
+	while ((uint8_t)(snapshotSequence - sequence) > 1);
+	
+	return sequence;
 }
 
 
@@ -288,159 +706,290 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 	//ConfigSuccess &= Endpoint_ConfigureEndpoint(JOYSTICK_OUT_EPADDR, EP_TYPE_INTERRUPT, JOYSTICK_EPSIZE, 1);
 	//ConfigSuccess &= Endpoint_ConfigureEndpoint(JOYSTICK_IN_EPADDR, EP_TYPE_INTERRUPT, JOYSTICK_EPSIZE, 1);
 	
-	ConfigSuccess &=Endpoint_ConfigureEndpoint(JOYSTICK0_EPADDR, EP_TYPE_INTERRUPT, JOYSTICK_EPSIZE, 1);
-	ConfigSuccess &=Endpoint_ConfigureEndpoint(JOYSTICK1_EPADDR, EP_TYPE_INTERRUPT, JOYSTICK_EPSIZE, 1);
-	ConfigSuccess &=Endpoint_ConfigureEndpoint(JOYSTICK2_EPADDR, EP_TYPE_INTERRUPT, JOYSTICK_EPSIZE, 1);
-	ConfigSuccess &=Endpoint_ConfigureEndpoint(JOYSTICK3_EPADDR, EP_TYPE_INTERRUPT, JOYSTICK_EPSIZE, 1);
+	for (uint8_t interfaceNumber = 0; interfaceNumber < JOYSTICK_INTERFACE_COUNT; interfaceNumber++)
+	{
+		ConfigSuccess &=Endpoint_ConfigureEndpoint(JOYSTICK_EPADDR(interfaceNumber), EP_TYPE_INTERRUPT, JOYSTICK_EPSIZE, 1);
+		
+		idleRate[interfaceNumber] = JOYSTICK_DEFAULT_IDLE;
+	}
+	
+	// Every live report goes out once on the new configuration, so the host starts from the current state
+	for (uint8_t joystickNumber = 0; joystickNumber < JOYSTICK_PAD_COUNT; joystickNumber++)
+		reportStates[joystickNumber].changed = true;
+	
+	// Relearn the host's polling phase, if reports are scheduled against it
+	PollSchedule_Init();
 	/* Indicate endpoint configuration success or failure */
 }
 
+#if defined(JOYSTICK_SOF_SCHEDULE)
+/** Event handler for the USB_StartOfFrame event, enabled by PollSchedule_Init(). This timestamps every USB frame so
+ *  that reports can be committed just ahead of the host's next poll.
+ */
+void EVENT_USB_Device_StartOfFrame(void)
+{
+	PollSchedule_StartOfFrame();
+}
+#endif
+
 /** Event handler for the USB_ControlRequest event. This is used to catch and process control requests sent to
  *  the device from the USB host before passing along unhandled control requests to the library for processing
  *  internally.
  */
 void EVENT_USB_Device_ControlRequest(void)
 {
+	/* Vendor requests belong to the measurement mode, apart from the shift clock timing */
+	if ((USB_ControlRequest.bmRequestType & CONTROL_REQTYPE_TYPE) == REQTYPE_VENDOR)
+	{
+		if (USB_ControlRequest.bRequest == SNESSHIFT_REQ_GetTiming)
+		  SNESShift_ControlRequest();
+		else
+		  Measurement_ControlRequest();
+
+		return;
+	}
+
 	/* Handle HID Class specific requests */
 	switch (USB_ControlRequest.bRequest)
 	{
 		case HID_REQ_GetReport:
-			if (USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE))
+			// The interface in wIndex selects the joystick
+			if ((USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE)) &&
+			    (USB_ControlRequest.wIndex < JOYSTICK_INTERFACE_COUNT))
 			{
-				USB_JoystickReport_Input_t JoystickReportData;
-
-			// Check which joystick the control request refers to:
-				switch (USB_ControlRequest.wIndex)
-				{
-					case 0x00:
-						// Create the next joystick0 HID report to send to the host
-						GetNextReport(&JoystickReportData, &previousJoystickReportData0, 0);
-
-						Endpoint_ClearSETUP();
-
-						// Write the joystick0 report data to the control endpoint
-						Endpoint_Write_Control_Stream_LE(&JoystickReportData, sizeof(JoystickReportData));
-						Endpoint_ClearOUT();
-						break;
-
-					case 0x01:
-						// Create the next joystick1 HID report to send to the host
-						GetNextReport(&JoystickReportData, &previousJoystickReportData1,  1);
-
-						Endpoint_ClearSETUP();
-
-						// Write the joystick1 report data to the control endpoint
-						Endpoint_Write_Control_Stream_LE(&JoystickReportData, sizeof(JoystickReportData));
-						Endpoint_ClearOUT();
-						break;
-					case 0x02:
-						// Create the next joystick1 HID report to send to the host
-						GetNextReport(&JoystickReportData, &previousJoystickReportData2,  2);
-
-						Endpoint_ClearSETUP();
-
-						// Write the joystick1 report data to the control endpoint
-						Endpoint_Write_Control_Stream_LE(&JoystickReportData, sizeof(JoystickReportData));
-						Endpoint_ClearOUT();
-						break;	
-					case 0x03:
-						// Create the next joystick1 HID report to send to the host
-						GetNextReport(&JoystickReportData, &previousJoystickReportData3,  3);
-
-						Endpoint_ClearSETUP();
-
-						// Write the joystick1 report data to the control endpoint
-						Endpoint_Write_Control_Stream_LE(&JoystickReportData, sizeof(JoystickReportData));
-						Endpoint_ClearOUT();
-						break;
-				}				
+				const uint16_t startTime = HAL_Timer_Read();
+
+				// Answer from the live reports without rebuilding them: they only change on the way to the
+				// interrupt endpoint, so they hold the reports last committed to it, and the control pipe
+				// leaves the interrupt path's change tracking alone
+#if defined(JOYSTICK_MULTIPLEXED)
+				const void* const JoystickReportData = joystickReports;
+				const uint16_t JoystickReportSize = sizeof(joystickReports);
+#else
+				const void* const JoystickReportData = &joystickReports[USB_ControlRequest.wIndex];
+				const uint16_t JoystickReportSize = sizeof(USB_JoystickReport_Input_t);
+#endif
+
+				Endpoint_ClearSETUP();
+
+				// Write the report data to the control endpoint, over as many packets as it needs
+				Endpoint_Write_Control_Stream_LE(JoystickReportData, JoystickReportSize);
+				Endpoint_ClearOUT();
+
+				Measurement_GetReportServed(startTime);
 			}
 
 			break;	
+		case HID_REQ_SetIdle:
+			if ((USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_CLASS | REQREC_INTERFACE)) &&
+			    (USB_ControlRequest.wIndex < JOYSTICK_INTERFACE_COUNT))
+			{
+				Endpoint_ClearSETUP();
+				Endpoint_ClearStatusStage();
+
+				// Idle duration is in the upper byte, in 4ms units (report ID in the lower byte is always 0)
+				idleRate[USB_ControlRequest.wIndex] = (USB_ControlRequest.wValue >> 8);
+			}
+
+			break;
+		case HID_REQ_GetIdle:
+			if ((USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE)) &&
+			    (USB_ControlRequest.wIndex < JOYSTICK_INTERFACE_COUNT))
+			{
+				Endpoint_ClearSETUP();
+
+				// Write the current idle duration to the host, in 4ms units
+				Endpoint_Write_8(idleRate[USB_ControlRequest.wIndex]);
+
+				Endpoint_ClearIN();
+				Endpoint_ClearStatusStage();
+			}
+
+			break;
 	}
 }
 
-/** Fills the given HID report data structure with the next HID report to send to the host.
- *
- *  \param[out] ReportData  Pointer to a HID report data structure to be filled
- *
- *  \return Boolean \c true if the new report differs from the last report, \c false otherwise
- */
-bool GetNextReport(USB_JoystickReport_Input_t* const ReportData, USB_JoystickReport_Input_t* const previousReportData, uint8_t joystickNumber)
+// Latch the de-bounced state changes queued since the last call, oldest first, and then the state of the
+// snapshot just read, which covers any change dropped from a full queue. A button whose state differs from
+// the last committed report is held as changed until a report has carried the change, so that a tap pressed
+// and released between two host polls still reaches the host. Costs one pass per queued event, however
+// many buttons each one changed.
+void consumeEvents(const struct joystickSnapshot* const snapshot)
 {
+	for (uint8_t joystickNumber = 0; joystickNumber < JOYSTICK_PAD_COUNT; joystickNumber++)
+	{
+		struct joystickReportState* const reportState = &reportStates[joystickNumber];
+		uint8_t tail = eventTail[joystickNumber];
+		
+		while (tail != eventHead[joystickNumber])
+		{
+			const volatile struct joystickEvent* const event = &events[joystickNumber][tail & (JOYSTICK_EVENT_QUEUE - 1)];
+			
+			reportState->latched |= (event->state ^ reportState->committedState);
+			
+			// Latency is timed from the oldest change the host has yet to see
+			if (!reportState->edgePending)
+			{
+				reportState->edgePending = true;
+				reportState->edgeTime = event->time;
+			}
+			
+			tail++;
+		}
+		
+		eventTail[joystickNumber] = tail;
+		
+		reportState->latched |= (snapshot->state[joystickNumber] ^ reportState->committedState);
+	}
+}
+
+// State the next report of a joystick is built from: the last committed state with every latched change
+// applied. This is the de-bounced state, unless a change was undone again before a report carried it.
+uint16_t reportedState(const uint8_t joystickNumber)
+{
+	return (reportStates[joystickNumber].committedState ^ reportStates[joystickNumber].latched);
+}
+
+// Record that the live report of a joystick was committed, so that its latched changes are released. Those
+// the de-bounced state has since undone are counted as held taps in a MEASUREMENT=1 build, which the report
+// would otherwise have dropped, and are latched again so the next report carries them back.
+void reportCommitted(const uint8_t joystickNumber, const uint16_t buttons)
+{
+	struct joystickReportState* const reportState = &reportStates[joystickNumber];
 	
-	bool inputChanged = false;
-	
-	/* Clear the report contents */
-	memset(ReportData, 0, sizeof(USB_JoystickReport_Input_t));
-	
-	//turn off unused joystick axis
-	ReportData->Slider = 128;
-	ReportData->Z = 128;
-	ReportData->HAT = 0xff;
-	
-	
-	// Set the joystick button status
-	if (!(joyStick[joystickNumber].button[MAP_FIREB_BUTTON].state == BUTTON_ON))	ReportData->Button |= ButtonMap[1];
-	if (!(joyStick[joystickNumber].button[MAP_FIREY_BUTTON].state == BUTTON_ON))	ReportData->Button |= ButtonMap[0];
-	if (!(joyStick[joystickNumber].button[MAP_SELECT_BUTTON].state == BUTTON_ON))	ReportData->Button |= ButtonMap[12];
-	if (!(joyStick[joystickNumber].button[MAP_START_BUTTON].state == BUTTON_ON))	ReportData->Button |= ButtonMap[9];
-	
-	//if (!(joyStick[joystickNumber].button[MAP_DOWN_BUTTON].state == BUTTON_ON))			ReportData->HAT = 0x01;
-	
-	//if (!(joyStick[joystickNumber].button[MAP_DOWN_BUTTON].state == BUTTON_ON))			ReportData->HAT = 0x04;
+	Measurement_TapsHeld(joystickNumber, reportState->latched & ~(buttons ^ reportState->committedState));
 	
-	//if (!(joyStick[joystickNumber].button[MAP_LEFT_BUTTON].state == BUTTON_ON))			ReportData->HAT = 0x06;
+	if (reportState->edgePending)
+	{
+		Measurement_EdgeReported(joystickNumber, reportState->edgeTime);
+		reportState->edgePending = false;
+	}
 	
-	//if (!(joyStick[joystickNumber].button[MAP_RIGHT_BUTTON].state == BUTTON_ON))			ReportData->HAT = 0x02;
+	reportState->committedState = reportState->state;
+	reportState->latched = (buttons ^ reportState->state);
+	reportState->changed = false;
+}
+
+/** Brings the live HID report of a joystick up to date with its de-bounced state. The report is only rebuilt when
+ *  the state changed since it was last built, and then only the fields that follow the state are written.
+ *
+ *  \param[in] joystickNumber  Joystick whose report is updated, in \ref joystickReports
+ *  \param[in] buttons         State to report, from reportedState() or a snapshot taken with readSnapshot()
+ *
+ *  \return Boolean \c true if the report changed since it was last sent on the interrupt endpoint, \c false otherwise
+ */
+bool GetNextReport(const uint8_t joystickNumber, const uint16_t buttons)
+{
 	
-	if (!(joyStick[joystickNumber].button[MAP_FIREA_BUTTON].state == BUTTON_ON))	ReportData->Button |= ButtonMap[2];
-	if (!(joyStick[joystickNumber].button[MAP_FIREX_BUTTON].state == BUTTON_ON))	ReportData->Button |= ButtonMap[3];
-	if (!(joyStick[joystickNumber].button[MAP_FIREL_BUTTON].state == BUTTON_ON))	ReportData->Button |= ButtonMap[4];
-	if (!(joyStick[joystickNumber].button[MAP_FIRER_BUTTON].state == BUTTON_ON))	ReportData->Button |= ButtonMap[5];
+	HAL_Bench_Mark(BENCH_STAGE_GetNextReport0 + joystickNumber);
 	
+	struct joystickReportState* const reportState = &reportStates[joystickNumber];
 	
-	// Set the left joystick direction states
-	if (!(joyStick[joystickNumber].button[MAP_UP_BUTTON].state == BUTTON_ON))			ReportData->Y = 0;
-	else if (!(joyStick[joystickNumber].button[MAP_DOWN_BUTTON].state == BUTTON_ON))	ReportData->Y = 255;
-	else ReportData->Y = 128;
+	if (buttons != reportState->state)
+	{
+		USB_JoystickReport_Input_t* const ReportData = &joystickReports[joystickNumber];
+		
+		// Translate the de-bounced SNES state into the Switch buttons, HAT and left stick
+		const directionMapEntry* const direction = &DirectionMap[(buttons >> (DPAD_NIBBLE * 4)) & 0x0F];
+		const uint16_t button = pgm_read_word(&ButtonMap[0][buttons & 0x0F]) |
+		                        pgm_read_word(&ButtonMap[1][(buttons >> 4) & 0x0F]) |
+		                        pgm_read_word(&ButtonMap[2][(buttons >> 8) & 0x0F]);
+		const uint8_t hat = pgm_read_byte(&direction->HAT);
+		const uint8_t x = pgm_read_byte(&direction->X);
+		const uint8_t y = pgm_read_byte(&direction->Y);
+		
+		// Buttons without a Switch mapping can change the state and leave the report as it was
+		if ((button != ReportData->Button) || (hat != ReportData->HAT) || (x != ReportData->X) || (y != ReportData->Y))
+		{
+			ReportData->Button = button;
+			ReportData->HAT = hat;
+			ReportData->X = x;
+			ReportData->Y = y;
+			
+			reportState->changed = true;
+		}
+		
+		reportState->state = buttons;
+	}
 	
-	if (!(joyStick[joystickNumber].button[MAP_LEFT_BUTTON].state == BUTTON_ON))		ReportData->X = 0;
-	else if (!(joyStick[joystickNumber].button[MAP_RIGHT_BUTTON].state == BUTTON_ON))	ReportData->X = 255;
-	else ReportData->X = 128;
+	// Back in HID_Task(), the only caller on the device
+	HAL_Bench_Mark(BENCH_STAGE_HIDTask);
 	
-	/*
-	// Set the right joystick direction states
-	if (!(joyStick[joystickNumber].button[MAP_UP_BUTTON].state == BUTTON_ON))			ReportData->Z = 0;
-	else if (!(joyStick[joystickNumber].button[MAP_DOWN_BUTTON].state == BUTTON_ON))	ReportData->Z = 255;
-	else ReportData->Z = 128;
+	return reportState->changed;
+}
+
+/** Applies the report emission policy to a freshly built report: it is sent if the joystick input changed, or if
+ *  the host's idle period has elapsed since the last report was sent. An idle rate of zero only sends on change.
+ *
+ *  \param[in] inputChanged    Whether the new report differs from the last one, as returned by GetNextReport()
+ *  \param[in] interfaceNumber Interface the report is sent on
+ *
+ *  \return Boolean \c true if the report should be sent, \c false if the endpoint should be left idle
+ */
+static bool isReportDue(const bool inputChanged, const uint8_t interfaceNumber)
+{
+	const uint16_t frameNumber = USB_Device_GetFrameNumber();
+	const uint16_t idleMS = (uint16_t)idleRate[interfaceNumber] * 4;
 	
-	if (!(joyStick[joystickNumber].button[MAP_LEFT_BUTTON].state == BUTTON_ON))		ReportData->Slider = 0;
-	else if (!(joyStick[joystickNumber].button[MAP_RIGHT_BUTTON].state == BUTTON_ON))	ReportData->Slider = 255;
-	else ReportData->Slider = 128;
-	*/
+	if (!inputChanged)
+	{
+		if (!idleMS) return false;
+		
+		// The frame number counts milliseconds in 11 bits, enough for the longest idle period of 1020ms
+		if (((frameNumber - lastReportFrame[interfaceNumber]) & 0x07FF) < idleMS) return false;
+	}
 	
-	// Check to see if the joystick state has changed since the last report was sent
-	if (ReportData->Button != previousReportData->Button) inputChanged = true;
-	if (ReportData->X != previousReportData->X) inputChanged = true;
-	if (ReportData->Y != previousReportData->Y) inputChanged = true;
+	lastReportFrame[interfaceNumber] = frameNumber;
+	return true;
+}
+
+#if !defined(JOYSTICK_MULTIPLEXED)
+/** Sends the next report of one joystick on its own interface, if its endpoint has a free bank and the report
+ *  is due.
+ *
+ *  \param[in] joystickNumber  Joystick whose endpoint is served
+ *
+ *  \return Boolean \c true if a report was committed to the endpoint, \c false otherwise
+ */
+static bool serviceJoystickEndpoint(const uint8_t joystickNumber)
+{
+	bool reportSent = false;
 	
-	// Save the current joystick status for later comparison
-	memcpy(previousReportData, ReportData, sizeof(USB_JoystickReport_Input_t));
+	const uint16_t state = reportedState(joystickNumber);
 	
-	return inputChanged;
+	// Ports without a pad leave their endpoint NAKing, once the report of a pulled out pad has been
+	// built from its released buttons (and so sent, or already known to the host)
+	if ((inputSnapshot.type[joystickNumber] != JOYSTICK_TYPE_PAD) && (state == reportStates[joystickNumber].state))
+		return false;
 	
-	/*
-	if(!(PINF & (1 << 4))) {
-	// button press
-	ReportData->Button |= ButtonMap[12];
-	ReportData->Slider = 255;
+	// Select the joystick's Report Endpoint
+	Endpoint_SelectEndpoint(JOYSTICK_EPADDR(joystickNumber));
+
+	// Check to see if the host is ready for another packet, and if the report is not being held
+	// back for the host's next poll
+	if (PollSchedule_IsStageTime(joystickNumber) && Endpoint_IsINReady())
+	{
+		bool inputChanged = GetNextReport(joystickNumber, state);
+
+		/* Only send the new HID report if it changed or the keepalive is due */
+		if (isReportDue(inputChanged, joystickNumber))
+		{
+			/* Write Joystick Report Data, straight from the live report */
+			Endpoint_Write_Stream_LE(&joystickReports[joystickNumber], sizeof(USB_JoystickReport_Input_t), NULL);
+
+			/* Finalize the stream transfer to send the last packet */
+			Endpoint_ClearIN();
+			PollSchedule_ReportStaged(joystickNumber);
+			reportCommitted(joystickNumber, inputSnapshot.state[joystickNumber]);
+			Measurement_ReportSent(joystickNumber);
+			
+			reportSent = true;
+		}
 	}
-	*/
-	
-	
 	
+	return reportSent;
 }
+#endif
 
 /** Function to manage HID report generation and transmission to the host. */
 void HID_Task(void)
@@ -450,87 +999,65 @@ void HID_Task(void)
 		if (USB_DeviceState != DEVICE_STATE_Configured)
 		  return;
 	
-	// Select the Joystick 0 Report Endpoint
-	Endpoint_SelectEndpoint(JOYSTICK0_EPADDR);
-
-	// Check to see if the host is ready for another packet
-	if (Endpoint_IsINReady())
-	{
-		USB_JoystickReport_Input_t JoystickReportData0;
-
-		/* Create the next HID report to send to the host */
-		GetNextReport(&JoystickReportData0,&previousJoystickReportData0, 0);
-
-		/* Write Joystick Report Data */
-		Endpoint_Write_Stream_LE(&JoystickReportData0, sizeof(JoystickReportData0), NULL);
-
-		/* Finalize the stream transfer to send the last packet */
-		Endpoint_ClearIN();
-
-		/* Clear the report data afterwards */
-		memset(&JoystickReportData0, 0, sizeof(JoystickReportData0));
-	}
+	// Close the report rate measurement window, if enabled
+	Measurement_Task();
 	
-	// Select the Joystick 1 Report Endpoint
-	Endpoint_SelectEndpoint(JOYSTICK1_EPADDR);
-	
-	// Check to see if the host is ready for another packet
-	if (Endpoint_IsINReady())
+	// Every report of this pass is built from the same snapshot, taken again only once a newer one is out
+	if (snapshotSequence != inputSequence)
 	{
-		USB_JoystickReport_Input_t JoystickReportData1;
-
-		/* Create the next HID report to send to the host */
-		GetNextReport(&JoystickReportData1,&previousJoystickReportData1, 1);
-
-		/* Write Joystick Report Data */
-		Endpoint_Write_Stream_LE(&JoystickReportData1, sizeof(JoystickReportData1), NULL);
-
-		/* Finalize the stream transfer to send the last packet */
-		Endpoint_ClearIN();
-
-		/* Clear the report data afterwards */
-		memset(&JoystickReportData1, 0, sizeof(JoystickReportData1));
+		inputSequence = readSnapshot(&inputSnapshot);
+		consumeEvents(&inputSnapshot);
 	}
-	// Select the Joystick 1 Report Endpoint
-	Endpoint_SelectEndpoint(JOYSTICK2_EPADDR);
 	
-	// Check to see if the host is ready for another packet
-	if (Endpoint_IsINReady())
-	{
-		USB_JoystickReport_Input_t JoystickReportData2;
-
-		/* Create the next HID report to send to the host */
-		GetNextReport(&JoystickReportData2,&previousJoystickReportData2, 2);
+#if defined(JOYSTICK_MULTIPLEXED)
+	// Every joystick shares the one Report Endpoint
+	Endpoint_SelectEndpoint(JOYSTICK_EPADDR(0));
 
-		/* Write Joystick Report Data */
-		Endpoint_Write_Stream_LE(&JoystickReportData2, sizeof(JoystickReportData2), NULL);
-
-		/* Finalize the stream transfer to send the last packet */
-		Endpoint_ClearIN();
+	// Check to see if the host is ready for another packet, and if the report is not being held
+	// back for the host's next poll
+	if (PollSchedule_IsStageTime(0) && Endpoint_IsINReady())
+	{
+		bool inputChanged = false;
+		
+		// Empty ports are included as well, holding the neutral report
+		for (uint8_t joystickNumber = 0; joystickNumber < JOYSTICK_PAD_COUNT; joystickNumber++)
+			inputChanged |= GetNextReport(joystickNumber, reportedState(joystickNumber));
+		
+		/* Only send the new HID report if any joystick changed or the keepalive is due */
+		if (isReportDue(inputChanged, 0))
+		{
+			/* Write Joystick Report Data, every pad's live report back to back */
+			Endpoint_Write_Stream_LE(joystickReports, sizeof(joystickReports), NULL);
 
-		/* Clear the report data afterwards */
-		memset(&JoystickReportData2, 0, sizeof(JoystickReportData2));
+			/* Finalize the stream transfer to send the last packet */
+			Endpoint_ClearIN();
+			PollSchedule_ReportStaged(0);
+			
+			for (uint8_t joystickNumber = 0; joystickNumber < JOYSTICK_PAD_COUNT; joystickNumber++)
+			{
+				reportCommitted(joystickNumber, inputSnapshot.state[joystickNumber]);
+				Measurement_ReportSent(joystickNumber);
+			}
+		}
 	}
-	// Select the Joystick 1 Report Endpoint
-	Endpoint_SelectEndpoint(JOYSTICK3_EPADDR);
+#else
+	// Endpoints are served round-robin, starting one pad further on after every pass that sent a report,
+	// so that no player's report is always the last written when several endpoints are ready at once
+	static uint8_t firstJoystick;
+	uint8_t joystickNumber = firstJoystick;
+	bool reportSent = false;
 	
-	// Check to see if the host is ready for another packet
-	if (Endpoint_IsINReady())
+	for (uint8_t served = 0; served < JOYSTICK_PAD_COUNT; served++)
 	{
-		USB_JoystickReport_Input_t JoystickReportData3;
-
-		/* Create the next HID report to send to the host */
-		GetNextReport(&JoystickReportData3,&previousJoystickReportData3, 3);
-
-		/* Write Joystick Report Data */
-		Endpoint_Write_Stream_LE(&JoystickReportData3, sizeof(JoystickReportData3), NULL);
-
-		/* Finalize the stream transfer to send the last packet */
-		Endpoint_ClearIN();
-
-		/* Clear the report data afterwards */
-		memset(&JoystickReportData3, 0, sizeof(JoystickReportData3));
+		reportSent |= serviceJoystickEndpoint(joystickNumber);
+		
+		if (++joystickNumber == JOYSTICK_PAD_COUNT)
+			joystickNumber = 0;
 	}
+	
+	if (reportSent && (++firstJoystick == JOYSTICK_PAD_COUNT))
+		firstJoystick = 0;
+#endif
 }
 
 
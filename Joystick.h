@@ -37,19 +37,13 @@
 #define _JOYSTICK_H_
 
 	/* Includes: */
-		#include <avr/io.h>
-		#include <avr/wdt.h>
-		#include <avr/power.h>
-		#include <avr/interrupt.h>
 		#include <string.h>
 
 		#include "Descriptors.h"
-
-		#include <LUFA/Drivers/USB/USB.h>
-		#include <LUFA/Drivers/Board/Joystick.h>
-		#include <LUFA/Drivers/Board/LEDs.h>
-		#include <LUFA/Drivers/Board/Buttons.h>
-		#include <LUFA/Platform/Platform.h>
+		#include "Lib/HAL.h"
+		#include "Lib/SNESShift.h"
+		#include "Lib/Measurement.h"
+		#include "Lib/PollSchedule.h"
 
 	/* Macros: */
 		/** LED mask for the library LED driver, to indicate that the USB interface is not ready. */
@@ -84,12 +78,103 @@
 		// The number of physical buttons
 		#define NUMBER_OF_BUTTONS		12
 	
-		// Define the de-bounce tolerance
-		#define DEBOUNCE_TOLERANCE		10
+		// Time a button's input must disagree with its de-bounced state, without a break, before the new
+		// state is accepted. Set by DEBOUNCE_US in the makefile.
+		#if !defined(DEBOUNCE_US)
+			#define DEBOUNCE_US		2000
+		#endif
+		
+		// With DEBOUNCE_EAGER defined (make DEBOUNCE_EAGER=1), a press is accepted on the first frame that
+		// sees it, and the button then ignores its input for this long so that contact chatter is not
+		// reported. Releases are still de-bounced over DEBOUNCE_US.
+		#if !defined(DEBOUNCE_LOCKOUT_US)
+			#define DEBOUNCE_LOCKOUT_US	5000
+		#endif
+		
+		#define DEBOUNCE_TICKS			((DEBOUNCE_US + HAL_TIMER_TICK_US - 1) / HAL_TIMER_TICK_US)
+		#define DEBOUNCE_LOCKOUT_TICKS	((DEBOUNCE_LOCKOUT_US + HAL_TIMER_TICK_US - 1) / HAL_TIMER_TICK_US)
+		
+		// De-bounce windows are timed on the 16-bit free-running timer, which must not wrap within one
+		#if ((DEBOUNCE_TICKS > 0x7FFF) || (DEBOUNCE_LOCKOUT_TICKS > 0x7FFF))
+			#error DEBOUNCE_US and DEBOUNCE_LOCKOUT_US must fit in half a period of the free-running timer.
+		#endif
+		
+		// The de-bounce counters are stepped DEBOUNCE_STEPS times per window on the free-running timer rather
+		// than on every frame. The first step can come right after the frame in which a button starts to
+		// disagree, so one more step is needed to be sure the whole window has passed, and a change is
+		// accepted between DEBOUNCE_US and one step later.
+		#define DEBOUNCE_STEPS			8
+		#define DEBOUNCE_STEP_TICKS		((DEBOUNCE_TICKS + DEBOUNCE_STEPS - 1) / DEBOUNCE_STEPS)
+		#define DEBOUNCE_TARGET			(DEBOUNCE_STEPS + 1)
+		#define DEBOUNCE_LOCKOUT_TARGET	(((DEBOUNCE_LOCKOUT_TICKS + DEBOUNCE_STEP_TICKS - 1) / DEBOUNCE_STEP_TICKS) + 1)
+		
+		// Number of bit planes in the vertical de-bounce counters. Up to DEBOUNCE_TARGET steps are added at
+		// once, so a counter one short of its target must be able to take that many more.
+		#if !defined(DEBOUNCE_COUNTER_BITS)
+			#define DEBOUNCE_COUNTER_BITS	5
+		#endif
+		
+		#if ((DEBOUNCE_TARGET - 1 + DEBOUNCE_TARGET) >= (1 << DEBOUNCE_COUNTER_BITS))
+			#error DEBOUNCE_COUNTER_BITS is too small for DEBOUNCE_STEPS.
+		#endif
+		
+		#if (defined(DEBOUNCE_EAGER) && ((DEBOUNCE_LOCKOUT_TARGET - 1 + DEBOUNCE_TARGET) >= (1 << DEBOUNCE_COUNTER_BITS)))
+			#error DEBOUNCE_COUNTER_BITS is too small for DEBOUNCE_LOCKOUT_US.
+		#endif
+		
+		// Mask of the button bits in a packed joystick state word
+		#define BUTTON_MASK		((1 << NUMBER_OF_BUTTONS) - 1)
+		
+		// Mask of the ID bits shifted out after the buttons, which read high (clear) on a standard pad
+		#define ID_MASK			(((1 << SNES_DATA_BITS) - 1) & ~BUTTON_MASK)
+		
+		// Number of de-bounced state changes of each joystick that can be queued for the USB side, a power of two
+		// no larger than 128. One change is queued per frame at most, and the queue is drained on every pass of
+		// HID_Task(), so it only fills up while the USB side is held up for several frames.
+		#if !defined(JOYSTICK_EVENT_QUEUE)
+			#define JOYSTICK_EVENT_QUEUE	8
+		#endif
+		
+		#if ((JOYSTICK_EVENT_QUEUE & (JOYSTICK_EVENT_QUEUE - 1)) || (JOYSTICK_EVENT_QUEUE > 128))
+			#error JOYSTICK_EVENT_QUEUE must be a power of two no larger than 128.
+		#endif
+		
+		// Ports with a joystick behind them, bit n for port n. Anything plugged into the others is ignored.
+		#define JOYSTICK_PORT_MASK	((1 << JOYSTICK_PAD_COUNT) - 1)
+		
+		// Number of frames in a row a port must be seen the same way before it is re-classified,
+		// so that a pad being plugged in or pulled out does not flicker between types
+		#define PRESENCE_FRAMES		4
 		
-		// Physical button states
-		#define BUTTON_OFF	0
-		#define BUTTON_ON	1
+		// While no port has a pad, the ports are only probed for a reconnect at this interval
+		#define PROBE_INTERVAL_MS	16
+		#define PROBE_INTERVAL_TICKS	((PROBE_INTERVAL_MS * 1000UL) / HAL_TIMER_TICK_US)
+		
+		// Default HID idle rate of each interface in 4ms units (125 = 500ms), used until the host sends
+		// SET_IDLE. An unchanged report is only re-sent once per idle period, 0 disables the keepalive.
+		#define JOYSTICK_DEFAULT_IDLE	125
+		
+		// Worst-case time for one full pass of the input pipeline: shifting in a frame from all
+		// pads, de-bouncing them, and building and writing a report for each. The per-pad CPU costs
+		// are rough estimates until measured with the cycle benchmark, stretched by
+		// SNES_SHIFT_LOAD_FACTOR when the shift interrupt runs alongside them.
+		#define PIPELINE_DEBOUNCE_US	(JOYSTICK_PAD_COUNT * 20)
+		#define PIPELINE_REPORT_US		(JOYSTICK_PAD_COUNT * 16)
+		#define PIPELINE_BUDGET_US		(SNES_FRAME_US + ((PIPELINE_DEBOUNCE_US + PIPELINE_REPORT_US) * SNES_SHIFT_LOAD_FACTOR))
+		
+		// Every polling interval must see at least one fresh frame for every pad. Only the frame time is
+		// exact, so the estimated CPU costs on top of it can only warn.
+		#if (SNES_FRAME_US > (JOYSTICK_POLLING_INTERVAL_MS * 1000))
+			#error A frame does not fit in JOYSTICK_POLLING_INTERVAL_MS.
+		#elif (PIPELINE_BUDGET_US > (JOYSTICK_POLLING_INTERVAL_MS * 1000))
+			#warning The estimated input pipeline may not fit in JOYSTICK_POLLING_INTERVAL_MS.
+		#endif
+		
+		// A hardware-clocked frame holds interrupts off throughout, and must leave a quarter of the lead
+		// kept on each poll for building and writing the report
+		#if ((SNES_SHIFT_MODE == SNES_SHIFT_MODE_HARDWARE) && (SNES_FRAME_US > ((POLL_SCHEDULE_LEAD_US * 3) / 4)))
+			#error SNES_BIT_PERIOD_US is too slow for the hardware clock to fit in POLL_SCHEDULE_LEAD_US.
+		#endif
 	
 	/* Type Defines: */
 		/** Type define for the joystick HID report structure, for creating and sending HID reports to the host PC.
@@ -107,6 +192,9 @@
 			uint8_t  VendorSpec;
 		} USB_JoystickReport_Input_t;
 
+		_Static_assert((sizeof(USB_JoystickReport_Input_t) * 8) == JOYSTICK_REPORT_INPUT_BITS,
+		               "USB_JoystickReport_Input_t does not match the report descriptor layout");
+
 		typedef struct
 		{
 			uint16_t Button; /**< Bit mask of the currently pressed joystick buttons */
@@ -117,6 +205,54 @@
 			uint8_t  Z; /**< Bit mask of the currently pressed joystick buttons */
 		} USB_JoystickReport_Output_t;
 
+		// What is plugged into a SNES port. Only standard pads are de-bounced and reported; the endpoints
+		// of other ports are left NAKing.
+		enum joystickTypes
+		{
+			JOYSTICK_TYPE_EMPTY, // Line still high on the presence clock
+			JOYSTICK_TYPE_PAD, // Standard pad: line low on the presence clock and all ID bits high
+			JOYSTICK_TYPE_OTHER, // Something else answering with another ID, such as a mouse or NES pad
+		};
+
+		// Packed state of each joystick, one bit per button in shift order (bit n holds the button shifted
+		// out on clock n, set while the button is held). Owned by the acquisition side: readJoystickStates()
+		// and performDebounce(). The de-bounce counters are vertical: bit n of plane k is bit k of the
+		// counter for button n, so one word operation steps all 12 counters.
+		struct joystickState
+		{
+			uint16_t physicalState; // As last read from the port, including the ID bits
+			uint16_t state; // De-bounced
+			uint16_t debounceCount[DEBOUNCE_COUNTER_BITS]; // De-bounce steps each pending change or lockout has run for
+			uint16_t debouncePending; // Buttons whose input disagrees with their state, being timed
+			uint16_t debounceLocked; // Buttons ignoring their input after an eager press
+			uint16_t inputTime; // Timer tick of the frame in which the input first disagreed with state
+			bool inputDiffers; // Input disagrees with state, and inputTime is running
+			uint8_t type; // From enum joystickTypes
+			uint8_t candidateType; // Differing type seen in the last candidateFrames frames
+			uint8_t candidateFrames;
+		};
+		
+		// One change of a joystick's de-bounced state, queued by performDebounce() for the USB side. Whatever
+		// the number of buttons that changed at once, it is one event.
+		struct joystickEvent
+		{
+			uint16_t time; // Timer tick of the frame in which the input first disagreed with the old state
+			uint16_t state; // De-bounced state from the change on
+		};
+		
+		// Consistent copy of the de-bounced state and type of every joystick, published by performDebounce()
+		// once per frame and read by the USB side through readSnapshot(), so that the USB side never sees
+		// some pads from one frame and some from the next
+		struct joystickSnapshot
+		{
+			uint16_t state[JOYSTICK_PAD_COUNT];
+			uint8_t type[JOYSTICK_PAD_COUNT];
+		};
+
+	/* External Variables: */
+		extern struct joystickState joyStick[JOYSTICK_PAD_COUNT];
+		extern USB_JoystickReport_Input_t joystickReports[JOYSTICK_PAD_COUNT];
+
 	/* Function Prototypes: */
 		void SetupHardware(void);
 		void HID_Task(void);
@@ -125,11 +261,17 @@
 		void EVENT_USB_Device_Disconnect(void);
 		void EVENT_USB_Device_ConfigurationChanged(void);
 		void EVENT_USB_Device_ControlRequest(void);
+		void EVENT_USB_Device_StartOfFrame(void);
 
-		void readJoystickStates(void);
+		bool readJoystickStates(void);
+		void storePhysicalStates(const uint16_t* const pressedStates, const uint8_t presentPorts);
 		void performDebounce(void);
+		uint8_t readSnapshot(struct joystickSnapshot* const snapshot);
+		void consumeEvents(const struct joystickSnapshot* const snapshot);
+		uint16_t reportedState(const uint8_t joystickNumber);
+		void reportCommitted(const uint8_t joystickNumber, const uint16_t buttons);
 		
-		bool GetNextReport(USB_JoystickReport_Input_t* const ReportData, USB_JoystickReport_Input_t* const previousReportData, uint8_t joystickNumber);
+		bool GetNextReport(const uint8_t joystickNumber, const uint16_t buttons);
 
 #endif
 
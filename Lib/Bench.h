@@ -0,0 +1,28 @@
+/** \file
+ *
+ *  Stage markers shared between the firmware and the cycle benchmark in Bench/.
+ *
+ *  A firmware built with \c BENCHMARK defined writes the ID of the main loop stage it is entering to
+ *  \c GPIOR0 through \c HAL_Bench_Mark(), a single \c OUT instruction. The shift timer ISR sets \c GPIOR1
+ *  on entry and clears it on exit through \c HAL_Bench_ISR(). The benchmark watches both registers under
+ *  simavr and charges every cycle to the stage (or ISR) that was active. This header has no dependencies
+ *  so that the host-side benchmark can include it.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+	/* Enums: */
+		/** Main loop stages reported by the benchmark, in loop order. */
+		enum Bench_Stages_t
+		{
+			BENCH_STAGE_None           = 0, /**< Start-up, before the main loop is entered */
+			BENCH_STAGE_Read           = 1, /**< readJoystickStates(), also marks the start of a loop pass */
+			BENCH_STAGE_Debounce       = 2, /**< performDebounce() */
+			BENCH_STAGE_HIDTask        = 3, /**< HID_Task(), less the GetNextReport() calls below */
+			BENCH_STAGE_GetNextReport0 = 4, /**< GetNextReport() for pad 0, pads 1-3 follow */
+			BENCH_STAGE_USBTask        = 8, /**< USB_USBTask() */
+			BENCH_STAGE_Count          = 9,
+		};
+
+#endif
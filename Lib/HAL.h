@@ -0,0 +1,372 @@
+/** \file
+ *
+ *  Thin hardware abstraction layer for the joystick pipeline. The SNES port GPIO, the busy-wait delay,
+ *  the free-running timestamp timer, the shift engine timer, the hardware shift clock and the few USB
+ *  controller flags that LUFA does not wrap are accessed only through the functions in this header, so
+ *  that the pipeline can be built either for the ATmega32U4 or natively against the simulator in Sim/.
+ *
+ *  On the target every function here is an always-inlined register access, so the generated code for
+ *  the hot path is identical to touching the port registers directly. When \c SIMULATOR is defined the
+ *  same names are resolved by Sim/Sim.c, and the LUFA endpoint API is provided by the simulated device
+ *  stack in Sim/LUFA/Drivers/USB/USB.h.
+ */
+
+#ifndef _HAL_H_
+#define _HAL_H_
+
+	/* Includes: */
+		#include "Bench.h"
+
+	#if !defined(SIMULATOR)
+		#include <avr/io.h>
+		#include <avr/wdt.h>
+		#include <avr/power.h>
+		#include <avr/interrupt.h>
+
+		#include <LUFA/Drivers/USB/USB.h>
+		#include <LUFA/Drivers/Board/Joystick.h>
+		#include <LUFA/Drivers/Board/LEDs.h>
+		#include <LUFA/Drivers/Board/Buttons.h>
+		#include <LUFA/Platform/Platform.h>
+	#else
+		#include <LUFA/Drivers/USB/USB.h>
+	#endif
+
+	/* Macros: */
+		/** Number of SNES controller ports wired to the board. */
+		#define HAL_SNES_PORTS            4
+
+		/** Period of one tick of the free-running timer returned by \ref HAL_Timer_Read(), in microseconds. */
+		#define HAL_TIMER_TICK_US         4
+
+		/** GPIO ports of the ATmega32U4, as used in the SNES data line pin map. */
+		#define HAL_PORT_B                0
+		#define HAL_PORT_C                1
+		#define HAL_PORT_D                2
+		#define HAL_PORT_E                3
+		#define HAL_PORT_F                4
+
+		#if !defined(HAL_SNES_DATA0_PORT)
+			/** Pin map of the SNES data lines: the GPIO port and bit each SNES port's data line is wired to. Set
+			 *  all eight from the makefile to match other board wiring.
+			 */
+			#define HAL_SNES_DATA0_PORT   HAL_PORT_F
+			#define HAL_SNES_DATA0_BIT    5
+			#define HAL_SNES_DATA1_PORT   HAL_PORT_F
+			#define HAL_SNES_DATA1_BIT    4
+			#define HAL_SNES_DATA2_PORT   HAL_PORT_B
+			#define HAL_SNES_DATA2_BIT    5
+			#define HAL_SNES_DATA3_PORT   HAL_PORT_B
+			#define HAL_SNES_DATA3_BIT    2
+		#endif
+
+		/** Mask of the pins of the given GPIO port that carry SNES data lines, zero if none do. */
+		#define HAL_SNES_DATA_PINS(Port)  (((HAL_SNES_DATA0_PORT == (Port)) ? (1 << HAL_SNES_DATA0_BIT) : 0) | \
+		                                   ((HAL_SNES_DATA1_PORT == (Port)) ? (1 << HAL_SNES_DATA1_BIT) : 0) | \
+		                                   ((HAL_SNES_DATA2_PORT == (Port)) ? (1 << HAL_SNES_DATA2_BIT) : 0) | \
+		                                   ((HAL_SNES_DATA3_PORT == (Port)) ? (1 << HAL_SNES_DATA3_BIT) : 0))
+
+		/** Gathers the SNES data lines found in \c Pins, one read of the given GPIO port, into bit n for SNES port n. */
+		#define HAL_SNES_GATHER(Port, Pins) \
+		                                  (((HAL_SNES_DATA0_PORT == (Port)) ? ((((Pins) >> HAL_SNES_DATA0_BIT) & 1) << 0) : 0) | \
+		                                   ((HAL_SNES_DATA1_PORT == (Port)) ? ((((Pins) >> HAL_SNES_DATA1_BIT) & 1) << 1) : 0) | \
+		                                   ((HAL_SNES_DATA2_PORT == (Port)) ? ((((Pins) >> HAL_SNES_DATA2_BIT) & 1) << 2) : 0) | \
+		                                   ((HAL_SNES_DATA3_PORT == (Port)) ? ((((Pins) >> HAL_SNES_DATA3_BIT) & 1) << 3) : 0))
+
+	#if !defined(SIMULATOR)
+		/** Busy-waits for the given compile-time constant number of microseconds. */
+		#define HAL_DelayUS(Microseconds) _delay_us(Microseconds)
+
+	/* Inline Functions: */
+		/** Disables the watchdog and clock prescaler left behind by the bootloader, and parks the unused
+		 *  PORTD pins as pulled-up inputs.
+		 */
+		static inline void HAL_Init(void) ATTR_ALWAYS_INLINE;
+		static inline void HAL_Init(void)
+		{
+			/* Disable watchdog if enabled by bootloader/fuses */
+			MCUSR &= ~(1 << WDRF);
+			wdt_disable();
+
+			/* Disable clock division */
+			clock_prescale_set(clock_div_1);
+
+			DDRD  &= ~0xFF;
+			PORTD |=  0xFF;
+		}
+
+		/** Configures the SNES data lines of the pin map as pulled-up inputs, and the shared clock and latch lines
+		 *  as outputs.
+		 */
+		static inline void HAL_SNES_Init(void) ATTR_ALWAYS_INLINE;
+		static inline void HAL_SNES_Init(void)
+		{
+			// data lines
+			DDRB  &= ~HAL_SNES_DATA_PINS(HAL_PORT_B);
+			PORTB |=  HAL_SNES_DATA_PINS(HAL_PORT_B);
+			DDRC  &= ~HAL_SNES_DATA_PINS(HAL_PORT_C);
+			PORTC |=  HAL_SNES_DATA_PINS(HAL_PORT_C);
+			DDRD  &= ~HAL_SNES_DATA_PINS(HAL_PORT_D);
+			PORTD |=  HAL_SNES_DATA_PINS(HAL_PORT_D);
+			DDRE  &= ~HAL_SNES_DATA_PINS(HAL_PORT_E);
+			PORTE |=  HAL_SNES_DATA_PINS(HAL_PORT_E);
+			DDRF  &= ~HAL_SNES_DATA_PINS(HAL_PORT_F);
+			PORTF |=  HAL_SNES_DATA_PINS(HAL_PORT_F);
+
+			// clock
+			DDRF  |= (1 << 7);
+			PORTF &= ~((1 << 7));
+
+			//latch
+			DDRF  |= (1 << 6);
+			PORTF &= ~((1 << 6));
+		}
+
+		static inline void HAL_SNES_LatchHigh(void) ATTR_ALWAYS_INLINE;
+		static inline void HAL_SNES_LatchHigh(void)
+		{
+			PORTF |= (1 << 6);
+		}
+
+		static inline void HAL_SNES_LatchLow(void) ATTR_ALWAYS_INLINE;
+		static inline void HAL_SNES_LatchLow(void)
+		{
+			PORTF &= ~(1 << 6);
+		}
+
+		static inline void HAL_SNES_ClockHigh(void) ATTR_ALWAYS_INLINE;
+		static inline void HAL_SNES_ClockHigh(void)
+		{
+			PORTF |= (1 << 7);
+		}
+
+		static inline void HAL_SNES_ClockLow(void) ATTR_ALWAYS_INLINE;
+		static inline void HAL_SNES_ClockLow(void)
+		{
+			PORTF &= ~(1 << 7);
+		}
+
+		/** Samples the data lines of all four SNES ports at once. Every GPIO port in the pin map is read once, and
+		 *  only those, back to back: with every line on one port this is a single \c PINx read. The line bits are
+		 *  then gathered with a \c bst / \c bld pair each, or not at all where the pin map already lines them up.
+		 *
+		 *  \return Bit n set if the data line of SNES port n is pulled low (button held, or pad present)
+		 */
+		static inline uint8_t HAL_SNES_ReadLines(void) ATTR_ALWAYS_INLINE;
+		static inline uint8_t HAL_SNES_ReadLines(void)
+		{
+			#if HAL_SNES_DATA_PINS(HAL_PORT_B)
+			const uint8_t PinsB = PINB;
+			#endif
+			#if HAL_SNES_DATA_PINS(HAL_PORT_C)
+			const uint8_t PinsC = PINC;
+			#endif
+			#if HAL_SNES_DATA_PINS(HAL_PORT_D)
+			const uint8_t PinsD = PIND;
+			#endif
+			#if HAL_SNES_DATA_PINS(HAL_PORT_E)
+			const uint8_t PinsE = PINE;
+			#endif
+			#if HAL_SNES_DATA_PINS(HAL_PORT_F)
+			const uint8_t PinsF = PINF;
+			#endif
+
+			uint8_t Lines = 0;
+
+			#if HAL_SNES_DATA_PINS(HAL_PORT_B)
+			Lines |= HAL_SNES_GATHER(HAL_PORT_B, PinsB);
+			#endif
+			#if HAL_SNES_DATA_PINS(HAL_PORT_C)
+			Lines |= HAL_SNES_GATHER(HAL_PORT_C, PinsC);
+			#endif
+			#if HAL_SNES_DATA_PINS(HAL_PORT_D)
+			Lines |= HAL_SNES_GATHER(HAL_PORT_D, PinsD);
+			#endif
+			#if HAL_SNES_DATA_PINS(HAL_PORT_E)
+			Lines |= HAL_SNES_GATHER(HAL_PORT_E, PinsE);
+			#endif
+			#if HAL_SNES_DATA_PINS(HAL_PORT_F)
+			Lines |= HAL_SNES_GATHER(HAL_PORT_F, PinsF);
+			#endif
+
+			/* Lines are pulled low by the pads, and idle high on the pull-ups */
+			return (Lines ^ ((1 << HAL_SNES_PORTS) - 1));
+		}
+
+		/** Generates one shift clock: a short low pulse followed by the rising edge that shifts the next bit
+		 *  out of every pad. The 4021 needs well under 1us of clock low time.
+		 */
+		static inline void HAL_SNES_ClockPulse(void) ATTR_ALWAYS_INLINE;
+		static inline void HAL_SNES_ClockPulse(void)
+		{
+			PORTF &= ~(1 << 7);
+			_delay_us(1);
+			PORTF |= (1 << 7);
+		}
+
+		/** Starts Timer 1 free-running at F_CPU/64, giving a \ref HAL_TIMER_TICK_US tick at 16MHz. */
+		static inline void HAL_Timer_Init(void) ATTR_ALWAYS_INLINE;
+		static inline void HAL_Timer_Init(void)
+		{
+			TCCR1A = 0;
+			TCCR1B = ((1 << CS11) | (1 << CS10));
+		}
+
+		/** Reads the free-running timer. The Start of Frame ISR timestamps frames with this too, and a 16-bit
+		 *  access through the shared TEMP register must not be split by another one, so interrupts are held
+		 *  off for the two byte reads.
+		 */
+		static inline uint16_t HAL_Timer_Read(void) ATTR_ALWAYS_INLINE;
+		static inline uint16_t HAL_Timer_Read(void)
+		{
+			uint_reg_t CurrentGlobalInt = GetGlobalInterruptMask();
+			GlobalInterruptDisable();
+
+			const uint16_t Ticks = TCNT1;
+
+			SetGlobalInterruptMask(CurrentGlobalInt);
+			return Ticks;
+		}
+
+		/** Starts Timer 3 in CTC mode at F_CPU/8, raising the \ref HAL_SHIFT_TIMER_ISR() compare interrupt every
+		 *  \c PeriodUS microseconds until \ref HAL_ShiftTimer_Stop() is called. Like \ref HAL_Timer_Read(), the
+		 *  16-bit writes go through the TEMP register shared with the Start of Frame ISR, so interrupts are held
+		 *  off around them.
+		 */
+		static inline void HAL_ShiftTimer_Start(const uint8_t PeriodUS) ATTR_ALWAYS_INLINE;
+		static inline void HAL_ShiftTimer_Start(const uint8_t PeriodUS)
+		{
+			uint_reg_t CurrentGlobalInt = GetGlobalInterruptMask();
+			GlobalInterruptDisable();
+
+			TCCR3A = 0;
+			TCCR3B = 0;
+			TCNT3  = 0;
+			OCR3A  = ((uint16_t)PeriodUS * ((F_CPU / 8) / 1000000)) - 1;
+			TIFR3  = (1 << OCF3A);
+			TIMSK3 = (1 << OCIE3A);
+			TCCR3B = ((1 << WGM32) | (1 << CS31));
+
+			SetGlobalInterruptMask(CurrentGlobalInt);
+		}
+
+		static inline void HAL_ShiftTimer_Stop(void) ATTR_ALWAYS_INLINE;
+		static inline void HAL_ShiftTimer_Stop(void)
+		{
+			TCCR3B = 0;
+			TIMSK3 = 0;
+		}
+
+		/** Starts Timer 3 generating the SNES clock in hardware on OC3A (PC6), in inverting fast PWM mode at
+		 *  F_CPU/1: every \c PeriodUS microseconds the line falls at the start of the period, and rises for the
+		 *  last \c HighUS microseconds of it. The counter starts at TOP, so the first falling edge is on the next
+		 *  tick. Timer 3 raises no interrupt in this mode, the caller follows the clock with
+		 *  \ref HAL_ShiftClock_WaitFalling().
+		 *
+		 *  OCR3A is double buffered in the PWM modes, so TOP, the compare value and the counter are all written
+		 *  with the timer stopped in normal mode, before the waveform mode is set and the clock started.
+		 */
+		static inline void HAL_ShiftClock_Start(const uint8_t PeriodUS, const uint8_t HighUS) ATTR_ALWAYS_INLINE;
+		static inline void HAL_ShiftClock_Start(const uint8_t PeriodUS, const uint8_t HighUS)
+		{
+			DDRC  |= (1 << 6);
+			PORTC |= (1 << 6);
+
+			TCCR3B = 0;
+			TCCR3A = 0;
+			TIMSK3 = 0;
+			ICR3   = ((uint16_t)PeriodUS * (F_CPU / 1000000)) - 1;
+			OCR3A  = ((uint16_t)(PeriodUS - HighUS) * (F_CPU / 1000000));
+			TCNT3  = ICR3;
+			TIFR3  = ((1 << TOV3) | (1 << OCF3A));
+			TCCR3A = ((1 << COM3A1) | (1 << COM3A0) | (1 << WGM31));
+			TCCR3B = ((1 << WGM33) | (1 << WGM32) | (1 << CS30));
+		}
+
+		/** Spins until the next falling edge of the hardware shift clock. */
+		static inline void HAL_ShiftClock_WaitFalling(void) ATTR_ALWAYS_INLINE;
+		static inline void HAL_ShiftClock_WaitFalling(void)
+		{
+			while (!(TIFR3 & (1 << TOV3)));
+			TIFR3 = (1 << TOV3);
+		}
+
+		/** Checks that the hardware shift clock is still in the low phase entered at the last
+		 *  \ref HAL_ShiftClock_WaitFalling(), i.e. that no rising edge has shifted the pads since.
+		 *
+		 *  \return Boolean \c true if the clock has not risen yet, \c false otherwise
+		 */
+		static inline bool HAL_ShiftClock_IsLow(void) ATTR_ALWAYS_INLINE;
+		static inline bool HAL_ShiftClock_IsLow(void)
+		{
+			return (!(TIFR3 & (1 << TOV3)) && (TCNT3 < OCR3A));
+		}
+
+		/** Stops the hardware shift clock. OC3A is disconnected, and PC6 returns to its idle high level. */
+		static inline void HAL_ShiftClock_Stop(void) ATTR_ALWAYS_INLINE;
+		static inline void HAL_ShiftClock_Stop(void)
+		{
+			TCCR3B = 0;
+			TCCR3A = 0;
+		}
+
+		/** Checks whether the USB controller has NAKed an IN token on the selected endpoint since the last call,
+		 *  meaning the host polled it while no bank was committed, and clears the flag.
+		 *
+		 *  \return Boolean \c true if an IN token was NAKed, \c false otherwise
+		 */
+		static inline bool HAL_Endpoint_TakeNAKedIN(void) ATTR_ALWAYS_INLINE;
+		static inline bool HAL_Endpoint_TakeNAKedIN(void)
+		{
+			if (!(UEINTX & (1 << NAKINI)))
+			  return false;
+
+			UEINTX &= ~(1 << NAKINI);
+			return true;
+		}
+
+		/** Declares the handler for the shift timer compare interrupt. */
+		#define HAL_SHIFT_TIMER_ISR()     ISR(TIMER3_COMPA_vect)
+	#else
+		/** Advances simulated time instead of spinning. */
+		#define HAL_DelayUS(Microseconds) Sim_AdvanceTimeUS(Microseconds)
+
+	/* Function Prototypes: */
+		void     HAL_Init(void);
+		void     HAL_SNES_Init(void);
+		void     HAL_SNES_LatchHigh(void);
+		void     HAL_SNES_LatchLow(void);
+		void     HAL_SNES_ClockHigh(void);
+		void     HAL_SNES_ClockLow(void);
+		uint8_t  HAL_SNES_ReadLines(void);
+		void     HAL_SNES_ClockPulse(void);
+		void     HAL_Timer_Init(void);
+		uint16_t HAL_Timer_Read(void);
+		void     HAL_ShiftTimer_Start(const uint8_t PeriodUS);
+		void     HAL_ShiftTimer_Stop(void);
+		void     HAL_ShiftClock_Start(const uint8_t PeriodUS, const uint8_t HighUS);
+		void     HAL_ShiftClock_WaitFalling(void);
+		bool     HAL_ShiftClock_IsLow(void);
+		void     HAL_ShiftClock_Stop(void);
+		bool     HAL_Endpoint_TakeNAKedIN(void);
+
+		/** Declares the handler for the shift timer compare interrupt, which the simulated timer calls directly. */
+		#define HAL_SHIFT_TIMER_ISR()     void HAL_ShiftTimer_ISR(void)
+		HAL_SHIFT_TIMER_ISR();
+
+		void     Sim_AdvanceTimeUS(const uint32_t Microseconds);
+	#endif
+
+	/* Macros: */
+	#if defined(BENCHMARK) && !defined(SIMULATOR)
+		/** Marks entry into the given main loop stage for the cycle benchmark, see Lib/Bench.h. */
+		#define HAL_Bench_Mark(Stage)     do { GPIOR0 = (Stage); } while (0)
+
+		/** Marks entry into (\c Active = 1) and exit from (\c Active = 0) the shift timer ISR. */
+		#define HAL_Bench_ISR(Active)     do { GPIOR1 = (Active); } while (0)
+	#else
+		#define HAL_Bench_Mark(Stage)     do { } while (0)
+		#define HAL_Bench_ISR(Active)     do { } while (0)
+	#endif
+
+#endif
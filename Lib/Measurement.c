@@ -0,0 +1,188 @@
+/** \file
+ *
+ *  On-device report rate measurement, see Measurement.h.
+ */
+
+#include <string.h>
+
+#include "Measurement.h"
+
+#if defined(JOYSTICK_MEASUREMENT)
+
+/** Reports committed to each endpoint so far in the current window. */
+static uint16_t ReportCount[HAL_SNES_PORTS];
+
+/** Longest frame period seen so far in the current window, in \ref HAL_TIMER_TICK_US ticks. */
+static uint16_t MaxFramePeriod;
+
+/** Timer value at the last completed frame, and whether it is valid yet. */
+static uint16_t LastFrameTime;
+static bool     LastFrameValid;
+
+/** USB frame number at which the current window started. */
+static uint16_t WindowStartFrame;
+
+/** Figures of the last completed window, as returned to the host. */
+static Measurement_ReportRate_t LastWindow;
+
+/** Latency histogram of each pad. */
+static Measurement_LatencyHistogram_t LatencyHistogram[HAL_SNES_PORTS];
+
+/** Service times of GET_REPORT requests, with the longest kept in \ref HAL_TIMER_TICK_US ticks until read. */
+static Measurement_ControlTiming_t ControlTiming;
+static uint16_t MaxServiceTime;
+
+/** Taps carried to the host only by the report side's hold, see \ref Measurement_TapsHeld(). */
+static Measurement_HeldTaps_t HeldTaps;
+
+/** Closes the current window once \ref MEASUREMENT_WINDOW_FRAMES USB frames have passed. Called once per
+ *  pass of the report task.
+ */
+void Measurement_Task(void)
+{
+	uint16_t FrameNumber = USB_Device_GetFrameNumber();
+
+	/* Frame numbers wrap at 11 bits, well above the window length */
+	if (((FrameNumber - WindowStartFrame) & 0x07FF) < MEASUREMENT_WINDOW_FRAMES)
+	  return;
+
+	for (uint8_t Pad = 0; Pad < HAL_SNES_PORTS; Pad++)
+	{
+		LastWindow.ReportsPerSecond[Pad] = ReportCount[Pad];
+		ReportCount[Pad] = 0;
+	}
+
+	LastWindow.MaxFramePeriodUS = (MaxFramePeriod * HAL_TIMER_TICK_US);
+	MaxFramePeriod   = 0;
+	WindowStartFrame = FrameNumber;
+}
+
+/** Records the time since the previous SNES frame was read. */
+void Measurement_FrameRead(void)
+{
+	uint16_t Now    = HAL_Timer_Read();
+	uint16_t Period = (Now - LastFrameTime);
+
+	if (LastFrameValid && (Period > MaxFramePeriod))
+	  MaxFramePeriod = Period;
+
+	LastFrameTime  = Now;
+	LastFrameValid = true;
+}
+
+/** Counts one report committed to the IN endpoint of the given pad. */
+void Measurement_ReportSent(const uint8_t Pad)
+{
+	ReportCount[Pad]++;
+}
+
+/** Adds a latency sample to a pad's histogram, for the first committed report carrying a de-bounced change.
+ *
+ *  \param[in] Pad       Pad whose report was committed
+ *  \param[in] EdgeTime  \ref HAL_Timer_Read() value of the frame in which the input first differed, from the
+ *                       change's event
+ */
+void Measurement_EdgeReported(const uint8_t Pad, const uint16_t EdgeTime)
+{
+	uint16_t Bucket = ((uint16_t)(HAL_Timer_Read() - EdgeTime) / (MEASUREMENT_LATENCY_BUCKET_US / HAL_TIMER_TICK_US));
+
+	if (Bucket >= MEASUREMENT_LATENCY_BUCKETS)
+	  Bucket = (MEASUREMENT_LATENCY_BUCKETS - 1);
+
+	if (LatencyHistogram[Pad].Count[Bucket] != UINT16_MAX)
+	  LatencyHistogram[Pad].Count[Bucket]++;
+}
+
+/** Records the time taken to serve one GET_REPORT request.
+ *
+ *  \param[in] StartTime  \ref HAL_Timer_Read() value when the request's handling began
+ */
+void Measurement_GetReportServed(const uint16_t StartTime)
+{
+	uint16_t ServiceTime = (HAL_Timer_Read() - StartTime);
+
+	if (ServiceTime > MaxServiceTime)
+	  MaxServiceTime = ServiceTime;
+
+	if (ControlTiming.GetReports != UINT16_MAX)
+	  ControlTiming.GetReports++;
+}
+
+/** Counts the taps of a pad carried by a committed report only because the report side held them, one per
+ *  button whose de-bounced state had already changed back by the time the report was committed.
+ *
+ *  \param[in] Pad      Pad whose report was committed
+ *  \param[in] Buttons  Mask of the held buttons
+ */
+void Measurement_TapsHeld(const uint8_t Pad, uint16_t Buttons)
+{
+	for (; Buttons; Buttons &= (Buttons - 1))
+	{
+		if (HeldTaps.Taps[Pad] != UINT16_MAX)
+		  HeldTaps.Taps[Pad]++;
+	}
+}
+
+/** Handles the vendor control requests of the measurement mode, see \ref Measurement_VendorRequests_t. */
+void Measurement_ControlRequest(void)
+{
+	switch (USB_ControlRequest.bRequest)
+	{
+		case MEASUREMENT_REQ_GetReportRate:
+			if (USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_DEVICE))
+			{
+				Endpoint_ClearSETUP();
+
+				Endpoint_Write_Control_Stream_LE(&LastWindow, sizeof(LastWindow));
+				Endpoint_ClearOUT();
+			}
+
+			break;
+		case MEASUREMENT_REQ_GetLatencyHistogram:
+			if ((USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_DEVICE)) &&
+			    (USB_ControlRequest.wIndex < HAL_SNES_PORTS))
+			{
+				Endpoint_ClearSETUP();
+
+				Endpoint_Write_Control_Stream_LE(&LatencyHistogram[USB_ControlRequest.wIndex],
+				                                 sizeof(Measurement_LatencyHistogram_t));
+				Endpoint_ClearOUT();
+			}
+
+			break;
+		case MEASUREMENT_REQ_ClearLatencyHistograms:
+			if (USB_ControlRequest.bmRequestType == (REQDIR_HOSTTODEVICE | REQTYPE_VENDOR | REQREC_DEVICE))
+			{
+				Endpoint_ClearSETUP();
+				Endpoint_ClearStatusStage();
+
+				memset(LatencyHistogram, 0, sizeof(LatencyHistogram));
+			}
+
+			break;
+		case MEASUREMENT_REQ_GetControlTiming:
+			if (USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_DEVICE))
+			{
+				ControlTiming.MaxServiceUS = (MaxServiceTime * HAL_TIMER_TICK_US);
+
+				Endpoint_ClearSETUP();
+
+				Endpoint_Write_Control_Stream_LE(&ControlTiming, sizeof(ControlTiming));
+				Endpoint_ClearOUT();
+			}
+
+			break;
+		case MEASUREMENT_REQ_GetHeldTaps:
+			if (USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_DEVICE))
+			{
+				Endpoint_ClearSETUP();
+
+				Endpoint_Write_Control_Stream_LE(&HeldTaps, sizeof(HeldTaps));
+				Endpoint_ClearOUT();
+			}
+
+			break;
+	}
+}
+
+#endif
@@ -0,0 +1,101 @@
+/** \file
+ *
+ *  Header file for Measurement.c, the optional on-device measurement mode.
+ *
+ *  When \c JOYSTICK_MEASUREMENT is defined (\c MEASUREMENT=1 in the makefile, and by default in the simulator),
+ *  the firmware counts the reports actually committed to each IN endpoint over one second windows, along
+ *  with the longest gap between two SNES frames. A host tool reads the last completed window back with the
+ *  \ref MEASUREMENT_REQ_GetReportRate vendor control request. Without the define every hook below is an
+ *  empty inline function, so the normal build carries no cost.
+ *
+ *  The same mode keeps a per-pad histogram of input-to-USB latency: the time from the first frame in which
+ *  a pad's raw input differs from its de-bounced state, to the \c Endpoint_ClearIN() of the first report
+ *  sent after the de-bounced state has followed. Each sample starts at the timestamp of the pad's queued
+ *  state change (see struct joystickEvent in Joystick.h), so raw changes that bounce back before being
+ *  accepted are not timed. Histograms are read with \ref MEASUREMENT_REQ_GetLatencyHistogram and reset with
+ *  \ref MEASUREMENT_REQ_ClearLatencyHistograms.
+ *
+ *  HID GET_REPORT requests are timed as well, from the start of their handling to the end of the status
+ *  stage, which is how long the main loop (and with it the interrupt reports) is held up by each one. The
+ *  count and the longest time are read with \ref MEASUREMENT_REQ_GetControlTiming.
+ *
+ *  Taps that only reached the host because the report side held them until a report had carried them, a
+ *  press and release (or release and re-press) both between two committed reports, are counted per pad and
+ *  read with \ref MEASUREMENT_REQ_GetHeldTaps. Without the hold every one of them would have been dropped. The
+ *  hold itself is always built in, only the count needs the measurement mode.
+ */
+
+#ifndef _MEASUREMENT_H_
+#define _MEASUREMENT_H_
+
+	/* Includes: */
+		#include "HAL.h"
+
+	/* Macros: */
+		/** Length of one measurement window, in USB frames (milliseconds). */
+		#define MEASUREMENT_WINDOW_FRAMES  1000
+
+		/** Width of one latency histogram bucket, in microseconds. */
+		#define MEASUREMENT_LATENCY_BUCKET_US  1000
+
+		/** Number of latency histogram buckets per pad, the last one also counting everything longer. */
+		#define MEASUREMENT_LATENCY_BUCKETS    16
+
+	/* Enums: */
+		/** Vendor specific control requests (\c bRequest values) handled by \ref Measurement_ControlRequest(). */
+		enum Measurement_VendorRequests_t
+		{
+			MEASUREMENT_REQ_GetReportRate         = 0x01, /**< Returns a \ref Measurement_ReportRate_t */
+			MEASUREMENT_REQ_GetLatencyHistogram   = 0x02, /**< Returns the histogram of the pad in \c wIndex */
+			MEASUREMENT_REQ_ClearLatencyHistograms = 0x03, /**< Resets the histograms of all pads */
+			MEASUREMENT_REQ_GetControlTiming      = 0x04, /**< Returns a \ref Measurement_ControlTiming_t */
+			MEASUREMENT_REQ_GetHeldTaps           = 0x05, /**< Returns a \ref Measurement_HeldTaps_t */
+		};
+
+	/* Type Defines: */
+		/** Result of the \ref MEASUREMENT_REQ_GetReportRate request, covering the last completed window. */
+		typedef struct
+		{
+			uint16_t ReportsPerSecond[HAL_SNES_PORTS]; /**< Reports committed to each IN endpoint */
+			uint16_t MaxFramePeriodUS; /**< Longest time between two completed SNES frames */
+		} ATTR_PACKED Measurement_ReportRate_t;
+
+		/** Result of the \ref MEASUREMENT_REQ_GetLatencyHistogram request. Counts saturate rather than wrap. */
+		typedef struct
+		{
+			uint16_t Count[MEASUREMENT_LATENCY_BUCKETS]; /**< Edges delivered within each bucket */
+		} ATTR_PACKED Measurement_LatencyHistogram_t;
+
+		/** Result of the \ref MEASUREMENT_REQ_GetControlTiming request, since the device was configured. */
+		typedef struct
+		{
+			uint16_t GetReports; /**< GET_REPORT requests served, saturating */
+			uint16_t MaxServiceUS; /**< Longest time spent serving one of them */
+		} ATTR_PACKED Measurement_ControlTiming_t;
+
+		/** Result of the \ref MEASUREMENT_REQ_GetHeldTaps request, since the device was powered. Counts saturate. */
+		typedef struct
+		{
+			uint16_t Taps[HAL_SNES_PORTS]; /**< Taps of each pad that a report carried only because they were held */
+		} ATTR_PACKED Measurement_HeldTaps_t;
+
+	/* Function Prototypes: */
+	#if defined(JOYSTICK_MEASUREMENT)
+		void Measurement_Task(void);
+		void Measurement_FrameRead(void);
+		void Measurement_ReportSent(const uint8_t Pad);
+		void Measurement_EdgeReported(const uint8_t Pad, const uint16_t EdgeTime);
+		void Measurement_GetReportServed(const uint16_t StartTime);
+		void Measurement_TapsHeld(const uint8_t Pad, uint16_t Buttons);
+		void Measurement_ControlRequest(void);
+	#else
+		static inline void Measurement_Task(void) {}
+		static inline void Measurement_FrameRead(void) {}
+		static inline void Measurement_ReportSent(const uint8_t Pad) {}
+		static inline void Measurement_EdgeReported(const uint8_t Pad, const uint16_t EdgeTime) {}
+		static inline void Measurement_GetReportServed(const uint16_t StartTime) {}
+		static inline void Measurement_TapsHeld(const uint8_t Pad, uint16_t Buttons) {}
+		static inline void Measurement_ControlRequest(void) {}
+	#endif
+
+#endif
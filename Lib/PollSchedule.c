@@ -0,0 +1,152 @@
+/** \file
+ *
+ *  Start-of-frame report scheduler, see PollSchedule.h.
+ */
+
+#include "PollSchedule.h"
+
+#if defined(JOYSTICK_SOF_SCHEDULE)
+
+/** USB frame number of the last IN token seen on each interface's endpoint. */
+static uint16_t LastPollFrame[JOYSTICK_INTERFACE_COUNT];
+
+/** Frames between two polls of each interface's endpoint, zero until it has been learned. */
+static uint8_t  PollPeriod[JOYSTICK_INTERFACE_COUNT];
+
+/** Set while a committed report is waiting in the bank of each interface's endpoint. */
+static bool     ReportWaiting[JOYSTICK_INTERFACE_COUNT];
+
+/** Timer value at the last start of frame. */
+static volatile uint16_t FrameStartTime;
+
+/** Forgets the polling phase of every endpoint and enables the start-of-frame event. Called once the device
+ *  has been configured.
+ */
+void PollSchedule_Init(void)
+{
+	for (uint8_t Interface = 0; Interface < JOYSTICK_INTERFACE_COUNT; Interface++)
+	{
+		PollPeriod[Interface]    = 0;
+		ReportWaiting[Interface] = false;
+	}
+
+	USB_Device_EnableSOFEvents();
+}
+
+/** Timestamps the start of a USB frame, called from the start-of-frame event. */
+void PollSchedule_StartOfFrame(void)
+{
+	FrameStartTime = HAL_Timer_Read();
+}
+
+/** Returns the timer ticks elapsed since the start of the current USB frame. */
+static uint16_t PollSchedule_FrameTicks(void)
+{
+	uint16_t FrameStart;
+
+	/* Re-read if the start-of-frame event updated the timestamp between the two byte reads */
+	do
+	{
+		FrameStart = FrameStartTime;
+	}
+	while (FrameStart != FrameStartTime);
+
+	return (HAL_Timer_Read() - FrameStart);
+}
+
+/** Records an IN token seen on an interface's endpoint during the given frame. Intervals longer than the
+ *  endpoint's polling interval span polls that went unseen, so only shorter ones update the period.
+ */
+static void PollSchedule_Polled(const uint8_t Interface, const uint16_t FrameNumber)
+{
+	uint16_t Frames = ((FrameNumber - LastPollFrame[Interface]) & 0x07FF);
+
+	if (Frames && (Frames <= JOYSTICK_POLLING_INTERVAL_MS))
+	  PollPeriod[Interface] = Frames;
+
+	LastPollFrame[Interface] = FrameNumber;
+}
+
+/** Decides whether the report of an interface should be committed now. Must be called on every pass of the
+ *  report task with the interface's endpoint selected, so that the host's polls are seen.
+ *
+ *  \param[in] Interface  Interface whose endpoint is selected
+ *
+ *  \return Boolean \c true if a report may be committed now, \c false if it should be held back
+ */
+bool PollSchedule_IsStageTime(const uint8_t Interface)
+{
+	const uint16_t FrameNumber = USB_Device_GetFrameNumber();
+	bool           Polled      = HAL_Endpoint_TakeNAKedIN();
+
+	if (ReportWaiting[Interface] && Endpoint_IsINReady())
+	{
+		ReportWaiting[Interface] = false;
+		Polled = true;
+	}
+
+	if (Polled)
+	  PollSchedule_Polled(Interface, FrameNumber);
+
+	const uint8_t Period = PollPeriod[Interface];
+
+	if (!(Period))
+	  return true;
+
+	uint16_t FramesToPoll = (((LastPollFrame[Interface] + Period) - FrameNumber) & 0x07FF);
+
+	/* Poll due in this frame, or overdue because it was missed or the host stopped polling */
+	if (!(FramesToPoll) || (FramesToPoll > Period))
+	  return true;
+
+	/* Poll due in the next frame: commit once its start is less than the lead away */
+	if (FramesToPoll == 1)
+	  return (PollSchedule_FrameTicks() >= ((1000 - POLL_SCHEDULE_LEAD_US) / HAL_TIMER_TICK_US));
+
+	return false;
+}
+
+/** Decides whether a new SNES frame should be latched now, or held back so that one is latched \p LeadUS before
+ *  the start of the frame of the next expected poll. A frame is only held back while it would still be in progress
+ *  at that point, so frames otherwise follow each other as fast as they are picked up.
+ *
+ *  \param[in] LeadUS   Time before the expected poll at which a frame should be latched
+ *  \param[in] FrameUS  Longest time to shift in one frame
+ *
+ *  \return Boolean \c true if a frame may be latched now, \c false if it should be held back
+ */
+bool PollSchedule_IsShiftTime(const uint16_t LeadUS, const uint16_t FrameUS)
+{
+	const uint16_t FrameNumber = USB_Device_GetFrameNumber();
+	uint16_t       PollFrames  = 0;
+
+	/* Soonest expected poll over every interface whose polling phase is known */
+	for (uint8_t Interface = 0; Interface < JOYSTICK_INTERFACE_COUNT; Interface++)
+	{
+		const uint8_t Period = PollPeriod[Interface];
+
+		if (!(Period))
+		  continue;
+
+		uint16_t FramesToPoll = (((LastPollFrame[Interface] + Period) - FrameNumber) & 0x07FF);
+
+		if (FramesToPoll && (FramesToPoll <= Period) && (!(PollFrames) || (FramesToPoll < PollFrames)))
+		  PollFrames = FramesToPoll;
+	}
+
+	if (!(PollFrames))
+	  return true;
+
+	int32_t UntilLatchUS = (((int32_t)PollFrames * 1000) - LeadUS -
+	                        ((int32_t)PollSchedule_FrameTicks() * HAL_TIMER_TICK_US));
+
+	return ((UntilLatchUS <= 0) || (UntilLatchUS >= FrameUS));
+}
+
+/** Notes that a report has been committed to an interface's endpoint, so that its collection is seen. */
+void PollSchedule_ReportStaged(const uint8_t Interface)
+{
+	ReportWaiting[Interface] = true;
+}
+
+#endif
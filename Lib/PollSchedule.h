@@ -0,0 +1,47 @@
+/** \file
+ *
+ *  Header file for PollSchedule.c, the optional start-of-frame report scheduler.
+ *
+ *  Normally a report is committed to its endpoint as soon as the input changes, and then waits in the bank
+ *  for the host's next IN token, so the data the host collects is anywhere from 0 to a whole polling
+ *  interval old. When \c JOYSTICK_SOF_SCHEDULE is defined (\c SOF_SCHEDULE=1 in the makefile), the firmware
+ *  learns the frames in which the host polls each endpoint, from the IN tokens it sees (NAKs on an empty
+ *  endpoint and collected reports), and holds each report back until \ref POLL_SCHEDULE_LEAD_US before the
+ *  start of the frame of the next expected poll. The start-of-frame event timestamps every frame, so that
+ *  the lead is timed from it. Changes that arrive while a report is held are folded into it. The SNES frames
+ *  are phased the same way, so that one is latched a whole input pipeline ahead of each expected poll rather
+ *  than wherever the free-running frames happen to fall.
+ *
+ *  Until the host's polling phase has been learned, or once an expected poll has been missed, reports are
+ *  committed straight away. Without the define every hook below is an empty inline function.
+ */
+
+#ifndef _POLLSCHEDULE_H_
+#define _POLLSCHEDULE_H_
+
+	/* Includes: */
+		#include "HAL.h"
+		#include "../Descriptors.h"
+
+	/* Macros: */
+		/** Time before the start of the frame in which a poll is expected that the report is committed, covering
+		 *  a pass of the main loop and building and writing the report.
+		 */
+		#define POLL_SCHEDULE_LEAD_US     150
+
+	/* Function Prototypes: */
+	#if defined(JOYSTICK_SOF_SCHEDULE)
+		void PollSchedule_Init(void);
+		void PollSchedule_StartOfFrame(void);
+		bool PollSchedule_IsStageTime(const uint8_t Interface);
+		void PollSchedule_ReportStaged(const uint8_t Interface);
+		bool PollSchedule_IsShiftTime(const uint16_t LeadUS, const uint16_t FrameUS);
+	#else
+		static inline void PollSchedule_Init(void) {}
+		static inline void PollSchedule_StartOfFrame(void) {}
+		static inline bool PollSchedule_IsStageTime(const uint8_t Interface) { return true; }
+		static inline void PollSchedule_ReportStaged(const uint8_t Interface) {}
+		static inline bool PollSchedule_IsShiftTime(const uint16_t LeadUS, const uint16_t FrameUS) { return true; }
+	#endif
+
+#endif
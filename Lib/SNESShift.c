@@ -0,0 +1,340 @@
+/** \file
+ *
+ *  Interrupt driven and hardware clocked SNES shift engine, see SNESShift.h.
+ */
+
+#include "SNESShift.h"
+
+/** Bit period of the frames started by \ref SNESShift_Start(), chosen by \ref SNESShift_Calibrate(). */
+static uint8_t BitPeriodUS = SNES_BIT_PERIOD_US;
+
+/** Candidate bit periods tried by \ref SNESShift_Calibrate(), slowest first. */
+static const uint8_t CalibrationPeriodsUS[] = SNES_CALIBRATION_PERIODS_US;
+
+#define SNES_CALIBRATION_STEPS    (sizeof(CalibrationPeriodsUS) / sizeof(CalibrationPeriodsUS[0]))
+
+/** Result of the last calibration, as returned by the \ref SNESSHIFT_REQ_GetTiming request. */
+static SNESShift_Timing_t Timing = { .BitPeriodUS = SNES_BIT_PERIOD_US };
+
+#if (SNES_SHIFT_MODE == SNES_SHIFT_MODE_HARDWARE)
+/** Set by SNESShift_StartAt(), and cleared once the requested frame has been shifted in and picked up. */
+static bool    FrameRequested;
+
+/** Bit period of the requested frame. */
+static uint8_t FramePeriodUS;
+
+/** Requests a new frame from all four ports at the given bit period. It is shifted in by the next call to
+ *  \ref SNESShift_GetFrame(), so that it is as fresh as it can be when picked up.
+ */
+static void SNESShift_StartAt(const uint8_t PeriodUS)
+{
+	FrameRequested = true;
+	FramePeriodUS  = PeriodUS;
+}
+
+/** Shifts in one frame from all four ports on the hardware clock, with interrupts disabled throughout.
+ *
+ *  \param[out] PressedStates  Array of \ref HAL_SNES_PORTS words, receiving the 16 data bits of each port
+ *  \param[out] PresentPorts   Receives the ports that held their line low on the presence clock, bit n for port n
+ *
+ *  \return Boolean \c true if every bit was sampled before the rising clock edge after it, \c false otherwise
+ */
+static bool SNESShift_ShiftFrame(uint16_t* const PressedStates, uint8_t* const PresentPorts)
+{
+	uint16_t Words[HAL_SNES_PORTS] = {0, 0, 0, 0};
+	uint8_t  Present;
+	bool     InTime = true;
+
+	uint_reg_t CurrentGlobalInt = GetGlobalInterruptMask();
+	GlobalInterruptDisable();
+
+	HAL_SNES_LatchLow();
+
+	/* High for the last half of the bit, rounded down: 1us of a 3us bit */
+	HAL_ShiftClock_Start(FramePeriodUS, (FramePeriodUS / 2));
+
+	for (uint8_t Bit = 0; Bit < SNES_DATA_BITS; Bit++)
+	{
+		HAL_ShiftClock_WaitFalling();
+
+		SNESShift_ShiftIn(Words, HAL_SNES_ReadLines());
+
+		if (!(HAL_ShiftClock_IsLow()))
+		  InTime = false;
+	}
+
+	HAL_ShiftClock_WaitFalling();
+
+	Present = HAL_SNES_ReadLines();
+
+	if (!(HAL_ShiftClock_IsLow()))
+	  InTime = false;
+
+	HAL_ShiftClock_Stop();
+	HAL_SNES_LatchHigh();
+
+	SetGlobalInterruptMask(CurrentGlobalInt);
+
+	if (!(InTime))
+	  return false;
+
+	for (uint8_t Port = 0; Port < HAL_SNES_PORTS; Port++)
+	  PressedStates[Port] = Words[Port];
+
+	*PresentPorts = Present;
+
+	return true;
+}
+
+/** Shifts in the frame requested by the last call to \ref SNESShift_Start(). A frame with a late sample is
+ *  dropped, and the request kept for the next call.
+ *
+ *  \param[out] PressedStates  Array of \ref HAL_SNES_PORTS words, receiving the 16 data bits of each port
+ *  \param[out] PresentPorts   Receives the ports that held their line low on the presence clock, bit n for port n
+ *
+ *  \return Boolean \c true if a complete frame was copied out, \c false if none was requested or it was dropped
+ */
+bool SNESShift_GetFrame(uint16_t* const PressedStates, uint8_t* const PresentPorts)
+{
+	if (!(FrameRequested) || !(SNESShift_ShiftFrame(PressedStates, PresentPorts)))
+	  return false;
+
+	FrameRequested = false;
+
+	return true;
+}
+#else
+/** Data lines sampled on each clock of the frame in progress, as returned by \ref HAL_SNES_ReadLines(). */
+static volatile uint8_t  ShiftSamples[SNES_SHIFT_BITS];
+
+/** Index of the next bit to be sampled by the ISR. */
+static volatile uint8_t  ShiftBit;
+
+/** Set by the ISR once the last bit of a frame has been sampled and the timer stopped. */
+static volatile bool     FrameComplete;
+
+/** Starts shifting in a new frame from all four ports at the given bit period. The latch line is released
+ *  here, and the first bit is sampled one bit period later from the shift timer interrupt.
+ */
+static void SNESShift_StartAt(const uint8_t PeriodUS)
+{
+	ShiftBit      = 0;
+	FrameComplete = false;
+
+	HAL_SNES_LatchLow();
+	HAL_ShiftTimer_Start(PeriodUS);
+}
+
+/** Retrieves the most recently completed frame, folding the samples taken by the ISR into one word per
+ *  port. The engine then stays idle until the next call to \ref SNESShift_Start().
+ *
+ *  \param[out] PressedStates  Array of \ref HAL_SNES_PORTS words, receiving the 16 data bits of each port
+ *  \param[out] PresentPorts   Receives the ports that held their line low on the presence clock, bit n for port n
+ *
+ *  \return Boolean \c true if a completed frame was copied out, \c false if none is waiting
+ */
+bool SNESShift_GetFrame(uint16_t* const PressedStates, uint8_t* const PresentPorts)
+{
+	uint16_t Words[HAL_SNES_PORTS] = {0, 0, 0, 0};
+
+	if (!(FrameComplete))
+	  return false;
+
+	for (uint8_t Bit = 0; Bit < SNES_DATA_BITS; Bit++)
+	  SNESShift_ShiftIn(Words, ShiftSamples[Bit]);
+
+	for (uint8_t Port = 0; Port < HAL_SNES_PORTS; Port++)
+	  PressedStates[Port] = Words[Port];
+
+	*PresentPorts = ShiftSamples[SNES_DATA_BITS];
+	FrameComplete = false;
+
+	return true;
+}
+
+/** Shift timer compare interrupt, sampling the data lines of every port and clocking out the next bit. */
+HAL_SHIFT_TIMER_ISR()
+{
+	HAL_Bench_ISR(1);
+
+	uint8_t Bit = ShiftBit;
+
+	ShiftSamples[Bit] = HAL_SNES_ReadLines();
+
+	HAL_SNES_ClockPulse();
+
+	if (++Bit == SNES_SHIFT_BITS)
+	{
+		HAL_ShiftTimer_Stop();
+		HAL_SNES_LatchHigh();
+
+		FrameComplete = true;
+	}
+
+	ShiftBit = Bit;
+
+	HAL_Bench_ISR(0);
+}
+#endif
+
+/** Starts a new frame at the calibrated bit period, see \ref SNESShift_Calibrate(). */
+void SNESShift_Start(void)
+{
+	SNESShift_StartAt(BitPeriodUS);
+}
+
+/** Starts a new frame at the fallback bit period, whatever the calibrated one. A pad plugged in on a cable too
+ *  slow for the calibrated period shows up as present in such a frame, while it reads as an empty port in
+ *  every other.
+ */
+void SNESShift_StartSlow(void)
+{
+	SNESShift_StartAt(SNES_FALLBACK_BIT_PERIOD_US);
+}
+
+/** Shifts in one frame at the given bit period and waits for it, for calibration.
+ *
+ *  \return Boolean \c true if the frame was shifted in, \c false if the hardware clock outran the sampling
+ */
+static bool SNESShift_ReadFrame(const uint8_t PeriodUS, uint16_t* const PressedStates, uint8_t* const PresentPorts)
+{
+	SNESShift_StartAt(PeriodUS);
+
+#if (SNES_SHIFT_MODE == SNES_SHIFT_MODE_HARDWARE)
+	return SNESShift_GetFrame(PressedStates, PresentPorts);
+#else
+	while (!(SNESShift_GetFrame(PressedStates, PresentPorts)))
+	  HAL_DelayUS(1);
+
+	return true;
+#endif
+}
+
+/** Reads a reference frame at the fallback bit period, which every port is assumed to manage. */
+static void SNESShift_ReadReference(uint16_t* const PressedStates, uint8_t* const PresentPorts)
+{
+	while (!(SNESShift_ReadFrame(SNES_FALLBACK_BIT_PERIOD_US, PressedStates, PresentPorts)));
+}
+
+/** Compares two frames over the given ports.
+ *
+ *  \return Mask of the ports whose data bits or presence bit differ, bit n for port n
+ */
+static uint8_t SNESShift_Mismatches(const uint16_t* const Words, const uint8_t Present,
+                                    const uint16_t* const OtherWords, const uint8_t OtherPresent, const uint8_t Ports)
+{
+	uint8_t Mismatched = ((Present ^ OtherPresent) & Ports);
+
+	for (uint8_t Port = 0; Port < HAL_SNES_PORTS; Port++)
+	{
+		if ((Ports & (1 << Port)) && (Words[Port] != OtherWords[Port]))
+		  Mismatched |= (1 << Port);
+	}
+
+	return Mismatched;
+}
+
+/** Picks the fastest bit period the pads plugged in can be read at reliably. No frame may be in progress.
+ *
+ *  Each candidate period in \ref SNES_CALIBRATION_PERIODS_US is tried in turn, slowest first, for
+ *  \ref SNES_CALIBRATION_FRAMES frames. A port passes a candidate while every frame read at it matches a
+ *  reference frame read at the fallback period: the same buttons, the same ID bits and the line low on the
+ *  presence clock. When a frame differs, the reference is read again, and a port whose reference changed
+ *  too had its input move rather than its data corrupted, so it is not failed for it. Once a port fails,
+ *  faster candidates are not tried on it.
+ *
+ *  Each port is then given the candidate one step slower than the fastest it passed, as a margin, and as
+ *  the clock is shared, every port is read at the slowest of those. The last candidate is only ever tried,
+ *  never used. Ports that are empty in the reference frame or not in use are left out, so that a pad on a
+ *  port without a joystick behind it cannot slow the clock down, and with every port left out the clock
+ *  goes back to \ref SNES_BIT_PERIOD_US.
+ *
+ *  This blocks for a few milliseconds, and is meant to be run when a pad is plugged in or pulled out.
+ *
+ *  \param[in] UsedPorts  Ports that are read into a joystick, bit n for port n
+ */
+void SNESShift_Calibrate(const uint8_t UsedPorts)
+{
+	uint16_t ReferenceWords[HAL_SNES_PORTS];
+	uint8_t  ReferencePresent;
+	uint8_t  PassedSteps[HAL_SNES_PORTS] = {0, 0, 0, 0};
+
+	SNESShift_ReadReference(ReferenceWords, &ReferencePresent);
+
+	const uint8_t Ports   = (ReferencePresent & UsedPorts);
+	uint8_t       Passing = Ports;
+
+	for (uint8_t Step = 0; (Step < SNES_CALIBRATION_STEPS) && Passing; Step++)
+	{
+		for (uint8_t Frame = 0; (Frame < SNES_CALIBRATION_FRAMES) && Passing; Frame++)
+		{
+			uint16_t Words[HAL_SNES_PORTS];
+			uint8_t  Present;
+			uint8_t  Mismatched = Passing;
+
+			if (SNESShift_ReadFrame(CalibrationPeriodsUS[Step], Words, &Present))
+			  Mismatched = SNESShift_Mismatches(Words, Present, ReferenceWords, ReferencePresent, Passing);
+
+			if (!(Mismatched))
+			  continue;
+
+			SNESShift_ReadReference(Words, &Present);
+
+			uint8_t Moved = SNESShift_Mismatches(Words, Present, ReferenceWords, ReferencePresent, Mismatched);
+
+			for (uint8_t Port = 0; Port < HAL_SNES_PORTS; Port++)
+			  ReferenceWords[Port] = Words[Port];
+
+			ReferencePresent = Present;
+			Passing &= ~(Mismatched & ~Moved);
+		}
+
+		for (uint8_t Port = 0; Port < HAL_SNES_PORTS; Port++)
+		{
+			if (Passing & (1 << Port))
+			  PassedSteps[Port]++;
+		}
+	}
+
+	uint8_t Step = (Ports) ? (SNES_CALIBRATION_STEPS - 1) : 0;
+
+	for (uint8_t Port = 0; Port < HAL_SNES_PORTS; Port++)
+	{
+		if (!(Ports & (1 << Port)))
+		{
+			Timing.PortBitPeriodUS[Port] = 0;
+			continue;
+		}
+
+		uint8_t PortStep = (PassedSteps[Port] > 1) ? (PassedSteps[Port] - 2) : 0;
+
+		if (PortStep < Step)
+		  Step = PortStep;
+
+		Timing.PortBitPeriodUS[Port] = CalibrationPeriodsUS[PortStep];
+	}
+
+	BitPeriodUS        = (Ports) ? CalibrationPeriodsUS[Step] : SNES_BIT_PERIOD_US;
+	Timing.BitPeriodUS = BitPeriodUS;
+
+	if (Timing.Calibrations < UINT8_MAX)
+	  Timing.Calibrations++;
+}
+
+/** Handles the \ref SNESShift_VendorRequests_t vendor control requests. */
+void SNESShift_ControlRequest(void)
+{
+	switch (USB_ControlRequest.bRequest)
+	{
+		case SNESSHIFT_REQ_GetTiming:
+			if (USB_ControlRequest.bmRequestType == (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_DEVICE))
+			{
+				Endpoint_ClearSETUP();
+
+				Endpoint_Write_Control_Stream_LE(&Timing, sizeof(Timing));
+				Endpoint_ClearOUT();
+			}
+
+			break;
+	}
+}
@@ -0,0 +1,158 @@
+/** \file
+ *
+ *  Header file for SNESShift.c, the interrupt driven SNES shift engine.
+ *
+ *  The engine clocks all four SNES ports from the Timer 3 compare interrupt, one interrupt per bit: the
+ *  ISR samples the four data lines, then pulses the clock to shift the next bit out. The main loop only
+ *  picks up finished frames through \ref SNESShift_GetFrame(), and starts the next one straight away with
+ *  \ref SNESShift_Start() so that the report path runs while the next frame is being shifted in.
+ *
+ *  With \c SNES_SHIFT_MODE_HARDWARE the clock is instead generated by Timer 3 itself on OC3A, which needs
+ *  the shared clock line wired to PC6 rather than PF7. The bit rate is then no longer limited by interrupt
+ *  entry and exit, but there is no interrupt left to sample on either: \ref SNESShift_Start() only requests
+ *  a frame, and \ref SNESShift_GetFrame() shifts it in on the spot, following the clock edges with
+ *  interrupts disabled. Each bit is sampled after its falling edge and checked to be taken before the
+ *  rising one, and a frame with a late sample is thrown away and shifted in again on the next call.
+ *
+ *  The bit period is picked at run time by \ref SNESShift_Calibrate(), which steps it down from the fallback
+ *  period until frames stop reading back the same, so that short cables are read as fast as they allow and
+ *  long extension runs get the one slower step they need. \ref SNESSHIFT_REQ_GetTiming reports the choice. A pad plugged in
+ *  on a cable too slow for the current period reads as an empty port, so \ref SNESShift_StartSlow() is
+ *  there to look for one now and then.
+ *
+ *  A frame is the 16 bits held in the 4021 (12 buttons and the 4 ID bits, which read high on a standard
+ *  pad), plus one presence bit sampled on the 17th clock. By then a pad has shifted in its grounded
+ *  serial input and holds the line low, while an empty port is still pulled high.
+ *
+ *  The timer mode costs the main loop one short interrupt per bit, where the busy-wait loop held it for a
+ *  whole frame, and the hardware mode holds interrupts off for one frame of 17 bit periods. Calibration
+ *  reads all its frames in one go with the main loop stalled. The cycle benchmark in Bench/ measures each
+ *  of these on the real firmware.
+ *
+ *  Every mode samples all four data lines at once with \ref HAL_SNES_ReadLines(), which reads each GPIO
+ *  port of the compile-time pin map once, and folds the sample into the per-port words with
+ *  \ref SNESShift_ShiftIn(), without a branch. This takes the same time however many lines are low, and
+ *  the timer ISR only stores the sample, leaving the words to be built when the frame is picked up.
+ */
+
+#ifndef _SNESSHIFT_H_
+#define _SNESSHIFT_H_
+
+	/* Includes: */
+		#include "HAL.h"
+
+	/* Macros: */
+		/** Shift mode using the original busy-wait loop inside \c readJoystickStates(). */
+		#define SNES_SHIFT_MODE_BLOCKING  0
+
+		/** Shift mode using the Timer 3 compare interrupt state machine in SNESShift.c. */
+		#define SNES_SHIFT_MODE_TIMER     1
+
+		/** Shift mode using the clock generated by Timer 3 on OC3A, followed from SNESShift.c. */
+		#define SNES_SHIFT_MODE_HARDWARE  2
+
+		#if !defined(SNES_SHIFT_MODE)
+			/** Selects how the SNES ports are read, may be overridden from the makefile. */
+			#define SNES_SHIFT_MODE       SNES_SHIFT_MODE_TIMER
+		#endif
+
+		/** Number of bits held in the shift register of a pad: 12 buttons, then the 4 ID bits. */
+		#define SNES_DATA_BITS            16
+
+		/** Number of bits clocked out of each port per frame, the data bits and then the presence bit. */
+		#define SNES_SHIFT_BITS           (SNES_DATA_BITS + 1)
+
+		#if (SNES_SHIFT_MODE == SNES_SHIFT_MODE_HARDWARE)
+			/** Time per shifted bit used until the ports have been calibrated. The clock is high for the last half
+			 *  of each bit, rounded down to whole microseconds, so a 3us bit is 2us low and 1us high. A frame holds
+			 *  interrupts off throughout, so there is no slower fallback: this keeps \ref SNES_FRAME_US inside the
+			 *  report lead of the poll schedule.
+			 */
+			#define SNES_BIT_PERIOD_US    6
+
+			/** Slowest time per shifted bit, for the calibration reference and the slow probe frames. */
+			#define SNES_FALLBACK_BIT_PERIOD_US  SNES_BIT_PERIOD_US
+
+			/** Bit periods tried by \ref SNESShift_Calibrate(), slowest first. The last one is too fast to sample
+			 *  in and only serves as a probe.
+			 */
+			#define SNES_CALIBRATION_PERIODS_US  {SNES_BIT_PERIOD_US, 4, 3, 2}
+
+			/** Factor main loop work is stretched by while a frame is being shifted in. Frames are shifted in
+			 *  with the main loop waiting rather than alongside it.
+			 */
+			#define SNES_SHIFT_LOAD_FACTOR  1
+		#elif (SNES_SHIFT_MODE == SNES_SHIFT_MODE_TIMER)
+			/** Time per shifted bit used until the ports have been calibrated, the 12us of the busy-wait loop. */
+			#define SNES_BIT_PERIOD_US    12
+
+			/** One step slower than \ref SNES_BIT_PERIOD_US, for long extension cables. Used for the calibration
+			 *  reference and the slow probe frames, and for ports that do not read reliably any faster.
+			 */
+			#define SNES_FALLBACK_BIT_PERIOD_US  16
+
+			/** Bit periods tried by \ref SNESShift_Calibrate(), slowest first. The last one would leave the main
+			 *  loop under half the CPU while a frame is shifted in, and only serves as a probe, so 10us is the
+			 *  fastest period used.
+			 */
+			#define SNES_CALIBRATION_PERIODS_US  {SNES_FALLBACK_BIT_PERIOD_US, SNES_BIT_PERIOD_US, 10, 8}
+
+			/** Factor main loop work is stretched by while a frame is being shifted in, with the shift interrupt
+			 *  taking up to half the CPU.
+			 */
+			#define SNES_SHIFT_LOAD_FACTOR  2
+		#else
+			/** Time per shifted bit, matching the 2 x 6us of the busy-wait loop, which is not calibrated. */
+			#define SNES_BIT_PERIOD_US    12
+
+			#define SNES_FALLBACK_BIT_PERIOD_US  SNES_BIT_PERIOD_US
+			#define SNES_CALIBRATION_PERIODS_US  {SNES_BIT_PERIOD_US}
+			#define SNES_SHIFT_LOAD_FACTOR  1
+		#endif
+
+		/** Longest time taken to shift in one complete frame from all ports, at the fallback bit period. */
+		#define SNES_FRAME_US             (SNES_SHIFT_BITS * SNES_FALLBACK_BIT_PERIOD_US)
+
+		/** Number of frames read at each candidate bit period during calibration. */
+		#define SNES_CALIBRATION_FRAMES   4
+
+	/* Enums: */
+		/** Vendor specific control requests (\c bRequest values) handled by \ref SNESShift_ControlRequest(). */
+		enum SNESShift_VendorRequests_t
+		{
+			SNESSHIFT_REQ_GetTiming               = 0x10, /**< Returns a \ref SNESShift_Timing_t */
+		};
+
+	/* Type Defines: */
+		/** Result of the \ref SNESSHIFT_REQ_GetTiming request, from the last calibration. */
+		typedef struct
+		{
+			uint8_t BitPeriodUS; /**< Bit period every port is read at */
+			uint8_t PortBitPeriodUS[HAL_SNES_PORTS]; /**< Bit period each port calibrated to, 0 for empty ports */
+			uint8_t Calibrations; /**< Calibrations run since power-up, saturating */
+		} ATTR_PACKED SNESShift_Timing_t;
+
+	/* Inline Functions: */
+		/** Shifts one sample of the data lines into the top of each port's word. After \ref SNES_DATA_BITS samples,
+		 *  bit n of each word holds the sample taken on clock n.
+		 *
+		 *  \param[in,out] Words  Array of \ref HAL_SNES_PORTS words being assembled
+		 *  \param[in]     Lines  Sample from \ref HAL_SNES_ReadLines(), bit n set if port n's line was low
+		 */
+		static inline void SNESShift_ShiftIn(uint16_t* const Words, const uint8_t Lines) ATTR_ALWAYS_INLINE;
+		static inline void SNESShift_ShiftIn(uint16_t* const Words, const uint8_t Lines)
+		{
+			Words[0] = ((Words[0] >> 1) | ((uint16_t)((Lines >> 0) & 1) << 15));
+			Words[1] = ((Words[1] >> 1) | ((uint16_t)((Lines >> 1) & 1) << 15));
+			Words[2] = ((Words[2] >> 1) | ((uint16_t)((Lines >> 2) & 1) << 15));
+			Words[3] = ((Words[3] >> 1) | ((uint16_t)((Lines >> 3) & 1) << 15));
+		}
+
+	/* Function Prototypes: */
+		void SNESShift_Start(void);
+		void SNESShift_StartSlow(void);
+		bool SNESShift_GetFrame(uint16_t* const PressedStates, uint8_t* const PresentPorts);
+		void SNESShift_Calibrate(const uint8_t UsedPorts);
+		void SNESShift_ControlRequest(void);
+
+#endif
@@ -0,0 +1,676 @@
+/** \file
+ *
+ *  Host-side model of the joystick hardware. This file implements the functions declared in Lib/HAL.h
+ *  and the subset of the LUFA device API used by the application, on top of a simulated microsecond
+ *  time base. Time only moves forward when the firmware waits (\ref HAL_DelayUS()) or when the harness
+ *  advances it explicitly; pending host IN polls are serviced as time passes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Sim.h"
+#include "Joystick.h"
+
+/** Model of one SNES controller and its 4021 parallel-in/serial-out shift register. */
+typedef struct
+{
+	bool     Connected;
+	uint16_t PressedMask; /**< Bit n set when the button shifted out on clock n is held */
+	uint32_t ShiftRegister; /**< Line levels still to be shifted out, LSB first */
+	uint32_t SettleUS; /**< Time the data line takes to follow a shift, as over a long cable */
+	uint32_t ShiftUS; /**< Time of the last shift */
+	bool     StaleLevel; /**< Line level before the last shift, read back until it has settled */
+} Sim_Pad_t;
+
+/** Model of one device endpoint and the bank FIFO in front of the host. */
+typedef struct
+{
+	bool     Configured;
+	uint8_t  Banks;
+	uint8_t  BusyBanks;
+	uint8_t  BankData[2][SIM_MAX_PACKET_SIZE];
+	uint16_t BankLength[2];
+	uint32_t BankCommitUS[2];
+	uint32_t BankInputUS[2]; /**< Latch time of the last complete SNES frame when each bank was committed */
+	uint8_t  BankHead;
+
+	uint8_t  WriteBuffer[SIM_MAX_PACKET_SIZE];
+	uint16_t WriteLength;
+
+	uint32_t NextPollUS;
+	bool     NAKedIN; /**< Set on a NAKed IN token, as the NAKINI flag of the hardware */
+	Sim_EndpointStats_t Stats;
+} Sim_Endpoint_t;
+
+volatile uint8_t     USB_DeviceState;
+USB_Request_Header_t USB_ControlRequest;
+
+static uint32_t       SimTimeUS;
+static Sim_Pad_t      Pads[HAL_SNES_PORTS];
+static bool           LatchLevel;
+static bool           ClockLevel;
+static uint8_t        ShiftClocks;
+static uint32_t       ShiftLatchUS;
+static uint32_t       InputLatchUS;
+
+static bool           InterruptsEnabled = true;
+
+static bool           ShiftTimerRunning;
+static uint32_t       ShiftTimerPeriodUS;
+static uint32_t       ShiftTimerNextUS;
+
+static bool           ShiftClockLow;
+static uint32_t       ShiftClockPeriodUS;
+static uint32_t       ShiftClockHighUS;
+static uint32_t       ShiftClockFallUS;
+
+static bool           SOFEventsEnabled;
+static uint32_t       NextSOFUS;
+
+static Sim_Endpoint_t Endpoints[SIM_MAX_ENDPOINTS];
+static uint8_t        SelectedEndpoint;
+static Sim_PacketCallback_t PacketCallback;
+static Sim_PollCallback_t   PollCallback;
+
+static uint8_t*       ControlData;
+static uint16_t       ControlLength;
+static uint16_t       ControlTransferred;
+static bool           ControlHandled;
+
+
+/** Reloads the shift register of a pad from its button state, as the 4021 does while latch is high.
+ *  A pressed button pulls its line low, and the four trailing ID bits of a standard pad read high.
+ *  Everything after bit 16 reads low because the serial input of the 4021 is tied to ground.
+ */
+static void Sim_LoadPad(Sim_Pad_t* const Pad)
+{
+	Pad->ShiftRegister = ((uint32_t)~Pad->PressedMask & 0x0FFF) | 0xF000;
+	Pad->StaleLevel    = (Pad->ShiftRegister & 1);
+}
+
+/** Runs the simulated host: every endpoint whose polling interval has elapsed is issued an IN token. */
+static void Sim_ServiceHost(void)
+{
+	for (uint8_t EndpointNumber = 1; EndpointNumber < SIM_MAX_ENDPOINTS; EndpointNumber++)
+	{
+		Sim_Endpoint_t* Endpoint = &Endpoints[EndpointNumber];
+
+		if (!(Endpoint->Configured) || !(Endpoint->Stats.IntervalMS))
+		  continue;
+
+		while ((int32_t)(SimTimeUS - Endpoint->NextPollUS) >= 0)
+		{
+			Endpoint->NextPollUS += (uint32_t)Endpoint->Stats.IntervalMS * 1000;
+
+			if (PollCallback)
+			  PollCallback(ENDPOINT_DIR_IN | EndpointNumber);
+
+			if (!(Endpoint->BusyBanks))
+			{
+				Endpoint->Stats.NAKs++;
+				Endpoint->NAKedIN = true;
+				continue;
+			}
+
+			uint8_t Bank = Endpoint->BankHead;
+
+			Endpoint->BankHead = (Endpoint->BankHead + 1) % Endpoint->Banks;
+			Endpoint->BusyBanks--;
+			Endpoint->Stats.Packets++;
+
+			/* Age of the data handed to the host, from the firmware committing it to the bank */
+			uint32_t AgeUS = (SimTimeUS - Endpoint->BankCommitUS[Bank]);
+
+			Endpoint->Stats.TotalAgeUS += AgeUS;
+			if (AgeUS > Endpoint->Stats.MaxAgeUS)
+			  Endpoint->Stats.MaxAgeUS = AgeUS;
+
+			/* Age of the input it carries, from the latch of the frame the firmware last had when committing */
+			uint32_t InputAgeUS = (SimTimeUS - Endpoint->BankInputUS[Bank]);
+
+			Endpoint->Stats.TotalInputAgeUS += InputAgeUS;
+			if (InputAgeUS > Endpoint->Stats.MaxInputAgeUS)
+			  Endpoint->Stats.MaxInputAgeUS = InputAgeUS;
+
+			if (PacketCallback)
+			  PacketCallback(ENDPOINT_DIR_IN | EndpointNumber, Endpoint->BankData[Bank], Endpoint->BankLength[Bank]);
+		}
+	}
+}
+
+/** Walks the configuration descriptor exactly as a host would, to learn each IN endpoint's polling interval. */
+static void Sim_Enumerate(void)
+{
+	const void* Address;
+	uint16_t    Size = CALLBACK_USB_GetDescriptor((DTYPE_Configuration << 8), 0, &Address);
+	const uint8_t* Descriptor = Address;
+
+	for (uint16_t Offset = 0; Offset < Size; Offset += Descriptor[Offset])
+	{
+		if (!(Descriptor[Offset]))
+		  break;
+
+		if (Descriptor[Offset + 1] == DTYPE_Endpoint)
+		{
+			const USB_Descriptor_Endpoint_t* EndpointDescriptor = (const void*)&Descriptor[Offset];
+			Sim_Endpoint_t* Endpoint = &Endpoints[EndpointDescriptor->EndpointAddress & ENDPOINT_EPNUM_MASK];
+
+			Endpoint->Stats.IntervalMS = EndpointDescriptor->PollingIntervalMS;
+			Endpoint->NextPollUS       = SimTimeUS + (uint32_t)EndpointDescriptor->PollingIntervalMS * 1000 +
+			                             SIM_POLL_OFFSET_US;
+		}
+	}
+}
+
+
+uint32_t Sim_GetTimeUS(void)
+{
+	return SimTimeUS;
+}
+
+void Sim_AdvanceTimeUS(const uint32_t Microseconds)
+{
+	uint32_t TargetUS = SimTimeUS + Microseconds;
+
+	/* Fire every shift timer compare interrupt and start-of-frame event that falls inside the step, in order.
+	 * While interrupts are masked they are held pending, and fire late once unmasked. */
+	while (InterruptsEnabled)
+	{
+		bool ShiftDue = (ShiftTimerRunning && ((int32_t)(TargetUS - ShiftTimerNextUS) >= 0));
+		bool SOFDue   = (SOFEventsEnabled && ((int32_t)(TargetUS - NextSOFUS) >= 0));
+
+		if (SOFDue && (!(ShiftDue) || ((int32_t)(ShiftTimerNextUS - NextSOFUS) >= 0)))
+		{
+			if ((int32_t)(NextSOFUS - SimTimeUS) > 0)
+			  SimTimeUS = NextSOFUS;
+
+			NextSOFUS += 1000;
+
+			Sim_ServiceHost();
+			EVENT_USB_Device_StartOfFrame();
+		}
+		else if (ShiftDue)
+		{
+			if ((int32_t)(ShiftTimerNextUS - SimTimeUS) > 0)
+			  SimTimeUS = ShiftTimerNextUS;
+
+			ShiftTimerNextUS += ShiftTimerPeriodUS;
+
+			Sim_ServiceHost();
+			HAL_ShiftTimer_ISR();
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	SimTimeUS = TargetUS;
+	Sim_ServiceHost();
+}
+
+/** Advances simulated time to the given absolute time, if it lies ahead. */
+static void Sim_AdvanceToUS(const uint32_t TimeUS)
+{
+	if ((int32_t)(TimeUS - SimTimeUS) > 0)
+	  Sim_AdvanceTimeUS(TimeUS - SimTimeUS);
+}
+
+void Sim_SetPadButtons(const uint8_t Port, const uint16_t PressedMask)
+{
+	Pads[Port].PressedMask = PressedMask;
+}
+
+void Sim_SetPadConnected(const uint8_t Port, const bool Connected)
+{
+	Pads[Port].Connected = Connected;
+}
+
+bool Sim_IsPadConnected(const uint8_t Port)
+{
+	return Pads[Port].Connected;
+}
+
+void Sim_SetPadSettleUS(const uint8_t Port, const uint32_t SettleUS)
+{
+	Pads[Port].SettleUS = SettleUS;
+}
+
+void Sim_SetPacketCallback(const Sim_PacketCallback_t Callback)
+{
+	PacketCallback = Callback;
+}
+
+void Sim_SetPollCallback(const Sim_PollCallback_t Callback)
+{
+	PollCallback = Callback;
+}
+
+void Sim_GetEndpointStats(const uint8_t EndpointAddress, Sim_EndpointStats_t* const Stats)
+{
+	*Stats = Endpoints[EndpointAddress & ENDPOINT_EPNUM_MASK].Stats;
+}
+
+/** Issues a control request to the application as the host would, returning the number of data stage
+ *  bytes moved through \c Data, or \c 0xFFFF if the application left the request unhandled.
+ */
+uint16_t Sim_ControlRequest(const USB_Request_Header_t* const Request,
+                            uint8_t* const Data,
+                            const uint16_t Length)
+{
+	USB_ControlRequest = *Request;
+	ControlData        = Data;
+	ControlLength      = Length;
+	ControlTransferred = 0;
+	ControlHandled     = false;
+
+	EVENT_USB_Device_ControlRequest();
+
+	return (ControlHandled) ? ControlTransferred : 0xFFFF;
+}
+
+/** Adds one latency sample to a pad's statistics. */
+void Sim_AddLatency(Sim_Latency_t* const Latency, const uint32_t DeltaUS)
+{
+	uint32_t Bucket = (DeltaUS / SIM_LATENCY_BUCKET_US);
+
+	if (!(Latency->Samples) || (DeltaUS < Latency->MinUS))
+	  Latency->MinUS = DeltaUS;
+	if (DeltaUS > Latency->MaxUS)
+	  Latency->MaxUS = DeltaUS;
+
+	if (Bucket >= SIM_LATENCY_BUCKETS)
+	  Bucket = (SIM_LATENCY_BUCKETS - 1);
+
+	Latency->Buckets[Bucket]++;
+	Latency->TotalUS += DeltaUS;
+	Latency->Samples++;
+}
+
+/** Returns the latency under which the given percentage of a pad's samples fall, rounded up to the end of
+ *  its bucket but no further than the longest sample, or \c 0 without samples.
+ */
+uint32_t Sim_LatencyPercentileUS(const Sim_Latency_t* const Latency, const uint8_t Percent)
+{
+	uint64_t Wanted = (((uint64_t)Latency->Samples * Percent) + 99) / 100;
+	uint64_t Seen   = 0;
+
+	if (!(Latency->Samples))
+	  return 0;
+
+	for (uint16_t Bucket = 0; Bucket < SIM_LATENCY_BUCKETS; Bucket++)
+	{
+		Seen += Latency->Buckets[Bucket];
+
+		if ((Seen >= Wanted) && (((Bucket + 1) * SIM_LATENCY_BUCKET_US) < Latency->MaxUS))
+		  return ((Bucket + 1) * SIM_LATENCY_BUCKET_US);
+		if (Seen >= Wanted)
+		  break;
+	}
+
+	return Latency->MaxUS;
+}
+
+/** Checks a pad's latency statistics against the pass/fail limits of a harness run, printing every limit that
+ *  was broken to stderr. A pad that delivered no edge at all fails as well.
+ *
+ *  \return Boolean \c true if the pad passed, \c false otherwise
+ */
+bool Sim_CheckLatency(const uint8_t Pad, const Sim_Latency_t* const Latency, const uint32_t MaxUS,
+                      const uint32_t P99US)
+{
+	bool     Passed = true;
+	uint32_t P99    = Sim_LatencyPercentileUS(Latency, 99);
+
+	if (!(Latency->Samples))
+	{
+		fprintf(stderr, "FAIL: pad %u delivered no edges\n", Pad);
+		return false;
+	}
+
+	if (Latency->MaxUS > MaxUS)
+	{
+		fprintf(stderr, "FAIL: pad %u max latency %lu us exceeds %lu us\n", Pad, (unsigned long)Latency->MaxUS,
+		        (unsigned long)MaxUS);
+		Passed = false;
+	}
+
+	if (P99 > P99US)
+	{
+		fprintf(stderr, "FAIL: pad %u p99 latency %lu us exceeds %lu us\n", Pad, (unsigned long)P99,
+		        (unsigned long)P99US);
+		Passed = false;
+	}
+
+	return Passed;
+}
+
+
+void HAL_Init(void)
+{
+	for (uint8_t Port = 0; Port < HAL_SNES_PORTS; Port++)
+	  Pads[Port].Connected = true;
+}
+
+void HAL_SNES_Init(void)
+{
+	LatchLevel = false;
+	ClockLevel = false;
+}
+
+void HAL_SNES_LatchHigh(void)
+{
+	LatchLevel = true;
+
+	for (uint8_t Port = 0; Port < HAL_SNES_PORTS; Port++)
+	  Sim_LoadPad(&Pads[Port]);
+}
+
+void HAL_SNES_LatchLow(void)
+{
+	/* The 4021 keeps loading its inputs for as long as latch is held high */
+	if (LatchLevel)
+	{
+		for (uint8_t Port = 0; Port < HAL_SNES_PORTS; Port++)
+		  Sim_LoadPad(&Pads[Port]);
+
+		ShiftLatchUS = SimTimeUS;
+		ShiftClocks  = 0;
+	}
+
+	LatchLevel = false;
+}
+
+void HAL_SNES_ClockHigh(void)
+{
+	/* Data shifts on the rising clock edge once latch has been released */
+	if (!(ClockLevel) && !(LatchLevel))
+	{
+		for (uint8_t Port = 0; Port < HAL_SNES_PORTS; Port++)
+		{
+			Pads[Port].StaleLevel      = (Pads[Port].ShiftRegister & 1);
+			Pads[Port].ShiftRegister >>= 1;
+			Pads[Port].ShiftUS         = SimTimeUS;
+		}
+
+		/* The frame is complete once the presence bit has been clocked out */
+		if (++ShiftClocks == SNES_SHIFT_BITS)
+		  InputLatchUS = ShiftLatchUS;
+	}
+
+	ClockLevel = true;
+}
+
+void HAL_SNES_ClockLow(void)
+{
+	ClockLevel = false;
+}
+
+/** Level of the data line of one SNES port, high while released or empty. */
+static bool Sim_ReadData(const uint8_t Port)
+{
+	/* An empty port reads high through the input pull-up */
+	if (!(Pads[Port].Connected))
+	  return true;
+
+	if (LatchLevel)
+	  Sim_LoadPad(&Pads[Port]);
+
+	if ((SimTimeUS - Pads[Port].ShiftUS) < Pads[Port].SettleUS)
+	  return Pads[Port].StaleLevel;
+
+	return (Pads[Port].ShiftRegister & 1);
+}
+
+uint8_t HAL_SNES_ReadLines(void)
+{
+	uint8_t Lines = 0;
+
+	for (uint8_t Port = 0; Port < HAL_SNES_PORTS; Port++)
+	{
+		if (!(Sim_ReadData(Port)))
+		  Lines |= (1 << Port);
+	}
+
+	return Lines;
+}
+
+void HAL_SNES_ClockPulse(void)
+{
+	HAL_SNES_ClockLow();
+	HAL_SNES_ClockHigh();
+}
+
+void HAL_Timer_Init(void)
+{
+}
+
+uint16_t HAL_Timer_Read(void)
+{
+	return (uint16_t)(SimTimeUS / HAL_TIMER_TICK_US);
+}
+
+void HAL_ShiftTimer_Start(const uint8_t PeriodUS)
+{
+	ShiftTimerRunning  = true;
+	ShiftTimerPeriodUS = PeriodUS;
+	ShiftTimerNextUS   = SimTimeUS + PeriodUS;
+}
+
+void HAL_ShiftTimer_Stop(void)
+{
+	ShiftTimerRunning = false;
+}
+
+/** Default shift timer interrupt handler, for shift modes that build none (on the target the vector stays empty). */
+void __attribute__((weak)) HAL_ShiftTimer_ISR(void)
+{
+}
+
+void HAL_ShiftClock_Start(const uint8_t PeriodUS, const uint8_t HighUS)
+{
+	/* The first falling edge follows on the next timer tick */
+	ShiftClockLow      = false;
+	ShiftClockPeriodUS = PeriodUS;
+	ShiftClockHighUS   = HighUS;
+	ShiftClockFallUS   = SimTimeUS;
+}
+
+void HAL_ShiftClock_WaitFalling(void)
+{
+	if (ShiftClockLow)
+	{
+		Sim_AdvanceToUS(ShiftClockFallUS + ShiftClockPeriodUS - ShiftClockHighUS);
+		HAL_SNES_ClockHigh();
+
+		ShiftClockFallUS += ShiftClockPeriodUS;
+	}
+
+	Sim_AdvanceToUS(ShiftClockFallUS);
+	HAL_SNES_ClockLow();
+
+	ShiftClockLow = true;
+}
+
+bool HAL_ShiftClock_IsLow(void)
+{
+	return ((int32_t)(SimTimeUS - (ShiftClockFallUS + ShiftClockPeriodUS - ShiftClockHighUS)) < 0);
+}
+
+void HAL_ShiftClock_Stop(void)
+{
+	/* The line returns to its idle high level at once */
+	if (ShiftClockLow)
+	  HAL_SNES_ClockHigh();
+
+	ShiftClockLow = false;
+}
+
+bool HAL_Endpoint_TakeNAKedIN(void)
+{
+	bool NAKedIN = Endpoints[SelectedEndpoint].NAKedIN;
+
+	Endpoints[SelectedEndpoint].NAKedIN = false;
+	return NAKedIN;
+}
+
+
+uint_reg_t GetGlobalInterruptMask(void)
+{
+	return InterruptsEnabled;
+}
+
+void SetGlobalInterruptMask(const uint_reg_t GlobalIntState)
+{
+	bool WasEnabled = InterruptsEnabled;
+
+	InterruptsEnabled = (GlobalIntState != 0);
+
+	/* Interrupts that became due while masked fire as soon as they are unmasked */
+	if (InterruptsEnabled && !(WasEnabled))
+	  Sim_AdvanceTimeUS(0);
+}
+
+void USB_Init(void)
+{
+	memset(Endpoints, 0, sizeof(Endpoints));
+	SOFEventsEnabled = false;
+
+	USB_DeviceState = DEVICE_STATE_Configured;
+
+	EVENT_USB_Device_Connect();
+	EVENT_USB_Device_ConfigurationChanged();
+
+	Sim_Enumerate();
+}
+
+void USB_USBTask(void)
+{
+	Sim_ServiceHost();
+}
+
+void USB_Device_EnableSOFEvents(void)
+{
+	SOFEventsEnabled = true;
+	NextSOFUS        = ((SimTimeUS / 1000) + 1) * 1000;
+}
+
+/** Default start-of-frame event handler, replaced by the application's when it has one (as in LUFA). */
+void __attribute__((weak)) EVENT_USB_Device_StartOfFrame(void)
+{
+}
+
+uint16_t USB_Device_GetFrameNumber(void)
+{
+	return (uint16_t)((SimTimeUS / 1000) & 0x07FF);
+}
+
+bool Endpoint_ConfigureEndpoint(const uint8_t Address,
+                                const uint8_t Type,
+                                const uint16_t Size,
+                                const uint8_t Banks)
+{
+	Sim_Endpoint_t* Endpoint = &Endpoints[Address & ENDPOINT_EPNUM_MASK];
+
+	if ((Size > SIM_MAX_PACKET_SIZE) || !(Banks) || (Banks > 2))
+	  return false;
+
+	Endpoint->Configured = true;
+	Endpoint->Banks      = Banks;
+	Endpoint->BusyBanks  = 0;
+	Endpoint->BankHead   = 0;
+
+	return true;
+}
+
+void Endpoint_SelectEndpoint(const uint8_t Address)
+{
+	SelectedEndpoint = (Address & ENDPOINT_EPNUM_MASK);
+}
+
+bool Endpoint_IsINReady(void)
+{
+	Sim_Endpoint_t* Endpoint = &Endpoints[SelectedEndpoint];
+
+	return (Endpoint->Configured && (Endpoint->BusyBanks < Endpoint->Banks));
+}
+
+void Endpoint_ClearIN(void)
+{
+	Sim_Endpoint_t* Endpoint = &Endpoints[SelectedEndpoint];
+
+	/* Control data is collected directly into the request buffer by Endpoint_Write_8() */
+	if (SelectedEndpoint == ENDPOINT_CONTROLEP)
+	  return;
+
+	/* The host may poll while the report is being written, and only sees it once committed */
+	Sim_AdvanceTimeUS(SIM_REPORT_WRITE_US);
+
+	uint8_t         Bank     = (Endpoint->BankHead + Endpoint->BusyBanks) % Endpoint->Banks;
+
+	memcpy(Endpoint->BankData[Bank], Endpoint->WriteBuffer, Endpoint->WriteLength);
+	Endpoint->BankLength[Bank]   = Endpoint->WriteLength;
+	Endpoint->BankCommitUS[Bank] = SimTimeUS;
+	Endpoint->BankInputUS[Bank]  = InputLatchUS;
+	Endpoint->WriteLength        = 0;
+	Endpoint->BusyBanks++;
+}
+
+void Endpoint_Write_8(const uint8_t Data)
+{
+	Sim_Endpoint_t* Endpoint = &Endpoints[SelectedEndpoint];
+
+	if (SelectedEndpoint == ENDPOINT_CONTROLEP)
+	{
+		if (ControlTransferred < ControlLength)
+		  ControlData[ControlTransferred++] = Data;
+	}
+	else if (Endpoint->WriteLength < SIM_MAX_PACKET_SIZE)
+	{
+		Endpoint->WriteBuffer[Endpoint->WriteLength++] = Data;
+	}
+}
+
+uint8_t Endpoint_Write_Stream_LE(const void* const Buffer,
+                                 uint16_t Length,
+                                 uint16_t* const BytesProcessed)
+{
+	const uint8_t* DataStream = Buffer;
+
+	while (Length--)
+	  Endpoint_Write_8(*(DataStream++));
+
+	return ENDPOINT_RWSTREAM_NoError;
+}
+
+void Endpoint_ClearSETUP(void)
+{
+	ControlHandled   = true;
+	SelectedEndpoint = ENDPOINT_CONTROLEP;
+}
+
+void Endpoint_ClearOUT(void)
+{
+}
+
+void Endpoint_ClearStatusStage(void)
+{
+}
+
+uint8_t Endpoint_Write_Control_Stream_LE(const void* const Buffer,
+                                         uint16_t Length)
+{
+	const uint8_t* DataStream = Buffer;
+
+	SelectedEndpoint = ENDPOINT_CONTROLEP;
+
+	while (Length--)
+	  Endpoint_Write_8(*(DataStream++));
+
+	/* The library waits for the host to finish the data and status stages */
+	Sim_AdvanceTimeUS(SIM_CONTROL_STAGES_US);
+	SelectedEndpoint = ENDPOINT_CONTROLEP;
+
+	return ENDPOINT_RWCSTREAM_NoError;
+}
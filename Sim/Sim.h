@@ -0,0 +1,133 @@
+/** \file
+ *
+ *  Header file for Sim.c, the host-side model of the joystick hardware. It provides a simulated time
+ *  base, four SNES controllers behind a 4021-style shift register, and a simulated LUFA endpoint layer
+ *  with a host that polls each IN endpoint at the interval advertised in the configuration descriptor.
+ */
+
+#ifndef _SIM_H_
+#define _SIM_H_
+
+	/* Includes: */
+		#include <stdint.h>
+		#include <stdbool.h>
+
+		#include "Lib/HAL.h"
+
+	/* Macros: */
+		/** Largest packet the simulated endpoint layer will buffer per bank. */
+		#define SIM_MAX_PACKET_SIZE       64
+
+		/** Number of endpoint numbers modelled, matching the ATmega32U4 (control endpoint plus six). */
+		#define SIM_MAX_ENDPOINTS         7
+
+		/** Offset of the host's IN tokens into their USB frame. Hosts schedule periodic transfers early in the
+		 *  frame, just after the start-of-frame packet.
+		 */
+		#define SIM_POLL_OFFSET_US        100
+
+		/** Time the host takes to collect the data stage of a control read and send its status stage, during
+		 *  which the application waits inside the control request handler.
+		 */
+		#define SIM_CONTROL_STAGES_US     250
+
+		/** Time charged for writing one report into an IN endpoint bank, the estimate of PIPELINE_REPORT_US. */
+		#define SIM_REPORT_WRITE_US       16
+
+		/** Width of one bucket of the latency statistics kept by the harnesses, in microseconds. */
+		#define SIM_LATENCY_BUCKET_US     100
+
+		/** Number of latency buckets, the last one also counting everything longer. */
+		#define SIM_LATENCY_BUCKETS       256
+
+		/** Longest 99th percentile input-to-host latency the harnesses accept on any pad before failing the run.
+		 *  These are pinned for each polling interval and interface layout, from runs of the default input script
+		 *  and de-bounce window in every shift mode, with and without \c DEBOUNCE_EAGER and \c SOF_SCHEDULE, plus
+		 *  some 300us of margin. Other settings must give their own limit through SIM_DEFS.
+		 */
+		#if !defined(SIM_P99_LATENCY_US)
+			#if (DEBOUNCE_US != 2000)
+				#error No latency limit is pinned for this DEBOUNCE_US, define SIM_P99_LATENCY_US in SIM_DEFS.
+			#elif defined(JOYSTICK_MULTIPLEXED)
+				#if (JOYSTICK_POLLING_INTERVAL_MS == 1)
+					#define SIM_P99_LATENCY_US  4500
+				#elif (JOYSTICK_POLLING_INTERVAL_MS == 2)
+					#define SIM_P99_LATENCY_US  6500
+				#elif (JOYSTICK_POLLING_INTERVAL_MS == 4)
+					#define SIM_P99_LATENCY_US  10800
+				#else
+					#define SIM_P99_LATENCY_US  12800
+				#endif
+			#else
+				#if (JOYSTICK_POLLING_INTERVAL_MS == 1)
+					#define SIM_P99_LATENCY_US  4000
+				#elif (JOYSTICK_POLLING_INTERVAL_MS == 2)
+					#define SIM_P99_LATENCY_US  5000
+				#elif (JOYSTICK_POLLING_INTERVAL_MS == 4)
+					#define SIM_P99_LATENCY_US  7000
+				#else
+					#define SIM_P99_LATENCY_US  8000
+				#endif
+			#endif
+		#endif
+
+		/** Longest input-to-host latency the harnesses accept on any one edge, with 500us of slack over the 99th
+		 *  percentile limit for the odd edge held up by calibration or control traffic.
+		 */
+		#if !defined(SIM_MAX_LATENCY_US)
+			#define SIM_MAX_LATENCY_US    (SIM_P99_LATENCY_US + 500)
+		#endif
+
+	/* Type Defines: */
+		/** Callback fired whenever the simulated host completes an IN transaction on an endpoint. */
+		typedef void (*Sim_PacketCallback_t)(const uint8_t EndpointAddress,
+		                                     const uint8_t* const Data,
+		                                     const uint16_t Length);
+
+		/** Callback fired whenever the simulated host issues an IN token to an endpoint, with or without data. */
+		typedef void (*Sim_PollCallback_t)(const uint8_t EndpointAddress);
+
+		/** Per-endpoint counters kept by the simulated host. */
+		typedef struct
+		{
+			uint32_t Packets; /**< IN transactions that returned data */
+			uint32_t NAKs; /**< IN transactions that found no committed bank */
+			uint8_t  IntervalMS; /**< Polling interval taken from the endpoint descriptor */
+			uint64_t TotalAgeUS; /**< Sum over delivered packets of the time spent committed in a bank */
+			uint32_t MaxAgeUS;
+			uint64_t TotalInputAgeUS; /**< Sum over delivered packets of the time since their SNES frame was latched */
+			uint32_t MaxInputAgeUS;
+		} Sim_EndpointStats_t;
+
+		/** Input-to-host latency statistics of one pad, as kept by the harnesses. */
+		typedef struct
+		{
+			uint32_t Samples;
+			uint32_t MinUS;
+			uint32_t MaxUS;
+			uint64_t TotalUS;
+			uint32_t Buckets[SIM_LATENCY_BUCKETS]; /**< Samples per \ref SIM_LATENCY_BUCKET_US wide bucket */
+		} Sim_Latency_t;
+
+	/* Function Prototypes: */
+		uint32_t Sim_GetTimeUS(void);
+
+		void     Sim_SetPadButtons(const uint8_t Port, const uint16_t PressedMask);
+		void     Sim_SetPadConnected(const uint8_t Port, const bool Connected);
+		bool     Sim_IsPadConnected(const uint8_t Port);
+		void     Sim_SetPadSettleUS(const uint8_t Port, const uint32_t SettleUS);
+
+		void     Sim_SetPacketCallback(const Sim_PacketCallback_t Callback);
+		void     Sim_SetPollCallback(const Sim_PollCallback_t Callback);
+		void     Sim_GetEndpointStats(const uint8_t EndpointAddress, Sim_EndpointStats_t* const Stats);
+
+		uint16_t Sim_ControlRequest(const USB_Request_Header_t* const Request,
+		                            uint8_t* const Data,
+		                            const uint16_t Length);
+
+		void     Sim_AddLatency(Sim_Latency_t* const Latency, const uint32_t DeltaUS);
+		uint32_t Sim_LatencyPercentileUS(const Sim_Latency_t* const Latency, const uint8_t Percent);
+		bool     Sim_CheckLatency(const uint8_t Pad, const Sim_Latency_t* const Latency, const uint32_t MaxUS,
+		                          const uint32_t P99US);
+
+#endif
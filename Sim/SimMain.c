@@ -0,0 +1,465 @@
+/** \file
+ *
+ *  Entry point of the host simulator build. This drives the same tasks as the firmware's main loop
+ *  against the simulated hardware in Sim.c, while a scripted player presses and releases buttons on
+ *  every pad. It reports the host CPU time spent in each main loop stage, the simulated loop period,
+ *  the traffic seen by each IN endpoint (with the age of its data when collected), and the input-to-host latency of every scripted edge.
+ *
+ *  The run fails, with a non-zero exit status, if any pad in use delivered no edge, or its latency exceeded
+ *  \ref SIM_MAX_LATENCY_US on any edge or \ref SIM_P99_LATENCY_US at the 99th percentile, so that a CI job
+ *  running "make sim_run" catches latency regressions.
+ *
+ *  When a trace file is given, every SNES frame and host poll of the run is recorded to it in the format
+ *  of Trace.h, for replay with JoystickReplay.
+ *
+ *  Usage: JoystickSim [passes] [trace]
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "Sim.h"
+#include "Trace.h"
+#include "Joystick.h"
+
+/** Interval between scripted input changes on each pad, in simulated microseconds. */
+#define SIM_INPUT_PERIOD_US       16000
+
+/** Simulated time charged for each main loop pass, standing in for the CPU time of the tasks themselves.
+ *  Waits inside the tasks (such as the busy-wait shift loop) advance simulated time on top of this.
+ */
+#define SIM_LOOP_US               20
+
+/** Interval between HID GET_REPORT requests from a simulated console polling the pads over the control pipe,
+ *  one interface after the other, in simulated microseconds. Zero (the default) leaves the control pipe idle;
+ *  set it through SIM_DEFS to see the effect of control traffic on the interrupt reports.
+ */
+#if !defined(SIM_CONSOLE_PERIOD_US)
+	#define SIM_CONSOLE_PERIOD_US     0
+#endif
+
+/** Time the data line of the first pad takes to follow each shift, as over a long extension cable, in
+ *  simulated microseconds. Zero (the default) models a short cable; set it through SIM_DEFS to see the
+ *  shift clock calibration back off for that port.
+ */
+#if !defined(SIM_CABLE_SETTLE_US)
+	#define SIM_CABLE_SETTLE_US       0
+#endif
+
+/** Time each scripted press is held for before it is released again, in simulated microseconds. Zero (the
+ *  default) holds it until the next scripted change; set it through SIM_DEFS to a few milliseconds to script
+ *  taps shorter than the host's polling interval.
+ */
+#if !defined(SIM_TAP_US)
+	#define SIM_TAP_US                0
+#endif
+
+/** Main loop stages timed by the harness. */
+enum Sim_Stages_t
+{
+	SIM_STAGE_Read,
+	SIM_STAGE_Debounce,
+	SIM_STAGE_HIDTask,
+	SIM_STAGE_USBTask,
+	SIM_STAGE_Count,
+};
+
+static const char* const StageNames[SIM_STAGE_Count] =
+{
+	"readJoystickStates",
+	"performDebounce",
+	"HID_Task",
+	"USB_USBTask",
+};
+
+/** Latency bookkeeping for one pad, from a scripted edge to the first delivered report that differs. */
+typedef struct
+{
+	uint8_t       LastReport[SIM_MAX_PACKET_SIZE];
+	bool          EdgePending;
+	uint32_t      EdgeTimeUS;
+	Sim_Latency_t Stats;
+} Sim_PadLatency_t;
+
+static Sim_PadLatency_t PadLatency[HAL_SNES_PORTS];
+static uint64_t         StageNS[SIM_STAGE_Count];
+
+static Trace_t          Trace;
+
+static uint64_t Sim_NowNS(void)
+{
+	struct timespec Now;
+
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	return ((uint64_t)Now.tv_sec * 1000000000ULL) + Now.tv_nsec;
+}
+
+/** Measures the cost of an empty pair of timestamps, which is subtracted from every stage timing. */
+static uint64_t Sim_TimerOverheadNS(void)
+{
+	uint64_t Best = UINT64_MAX;
+
+	for (uint16_t Sample = 0; Sample < 1000; Sample++)
+	{
+		uint64_t Start = Sim_NowNS();
+		uint64_t Delta = Sim_NowNS() - Start;
+
+		if (Delta < Best)
+		  Best = Delta;
+	}
+
+	return Best;
+}
+
+/** Small deterministic generator so that every run scripts the same input sequence. */
+static uint32_t Sim_Random(void)
+{
+	static uint32_t State = 0x12345678;
+
+	State = (State * 1103515245UL) + 12345;
+	return (State >> 16);
+}
+
+/** Times the pending edge of a pad once a delivered report for it differs from the previous one. */
+static void Sim_CheckReport(const uint8_t Pad,
+                            const uint8_t* const Data,
+                            const uint16_t Length)
+{
+	Sim_PadLatency_t* Latency = &PadLatency[Pad];
+
+	if (memcmp(Latency->LastReport, Data, Length) && Latency->EdgePending)
+	{
+		Sim_AddLatency(&Latency->Stats, Sim_GetTimeUS() - Latency->EdgeTimeUS);
+		Latency->EdgePending = false;
+	}
+
+	memcpy(Latency->LastReport, Data, Length);
+}
+
+static void Sim_OnPacket(const uint8_t EndpointAddress,
+                         const uint8_t* const Data,
+                         const uint16_t Length)
+{
+	uint8_t Interface = (EndpointAddress & ENDPOINT_EPNUM_MASK) - 1;
+
+#if defined(JOYSTICK_MULTIPLEXED)
+	/* Every pad's report is carried in each packet of the one interface */
+	for (uint8_t Pad = 0; (Interface == 0) && (Pad < JOYSTICK_PAD_COUNT); Pad++)
+	{
+		const uint16_t Offset = (Pad * sizeof(USB_JoystickReport_Input_t));
+
+		if (Length >= (Offset + sizeof(USB_JoystickReport_Input_t)))
+		  Sim_CheckReport(Pad, &Data[Offset], sizeof(USB_JoystickReport_Input_t));
+	}
+#else
+	if (Interface < HAL_SNES_PORTS)
+	  Sim_CheckReport(Interface, Data, Length);
+#endif
+}
+
+static void Sim_OnPoll(const uint8_t EndpointAddress)
+{
+	uint8_t Interface = (EndpointAddress & ENDPOINT_EPNUM_MASK) - 1;
+
+	if (!(Trace.File))
+	  return;
+
+#if defined(JOYSTICK_MULTIPLEXED)
+	/* A poll of the one interface polls every pad */
+	if (Interface == 0)
+	  Trace_WritePoll(&Trace, Sim_GetTimeUS(), JOYSTICK_PORT_MASK);
+#else
+	if (Interface < TRACE_PORTS)
+	  Trace_WritePoll(&Trace, Sim_GetTimeUS(), (1 << Interface));
+#endif
+}
+
+/** Records the frame just picked up by readJoystickStates() to the trace, if one is being written. */
+static void Sim_TraceFrame(void)
+{
+	uint16_t Words[TRACE_PORTS] = {0};
+	uint8_t  PresentMask        = 0;
+
+	if (!(Trace.File))
+	  return;
+
+	for (uint8_t Port = 0; Port < JOYSTICK_PAD_COUNT; Port++)
+	{
+		Words[Port] = joyStick[Port].physicalState;
+
+		if (Sim_IsPadConnected(Port))
+		  PresentMask |= (1 << Port);
+	}
+
+	Trace_WriteFrame(&Trace, Sim_GetTimeUS(), Words, PresentMask);
+}
+
+/** Alternates each pad between a single random held button and nothing held, so every edge is visible
+ *  in the report regardless of how the D-pad resolves opposing directions. With \c SIM_SYNC_INPUT defined
+ *  (through SIM_DEFS), every pad changes at the same moment as the first, so that all endpoints have a
+ *  report to send in the same pass and the order they are served in shows in their input age.
+ */
+static void Sim_ScriptInput(void)
+{
+	static uint32_t NextChangeUS[HAL_SNES_PORTS];
+	static bool     Held[HAL_SNES_PORTS];
+
+	for (uint8_t Port = 0; Port < HAL_SNES_PORTS; Port++)
+	{
+		if ((int32_t)(Sim_GetTimeUS() - NextChangeUS[Port]) < 0)
+		  continue;
+
+		Held[Port] = !(Held[Port]);
+		Sim_SetPadButtons(Port, (Held[Port]) ? (1 << (Sim_Random() % NUMBER_OF_BUTTONS)) : 0);
+
+		PadLatency[Port].EdgePending = true;
+		PadLatency[Port].EdgeTimeUS  = Sim_GetTimeUS();
+
+		if (SIM_TAP_US && Held[Port])
+		  NextChangeUS[Port] = Sim_GetTimeUS() + SIM_TAP_US;
+		else
+		  NextChangeUS[Port] = Sim_GetTimeUS() + SIM_INPUT_PERIOD_US + (Sim_Random() % 4000);
+
+#if defined(SIM_SYNC_INPUT)
+		if (Port)
+		  NextChangeUS[Port] = NextChangeUS[0];
+#endif
+	}
+}
+
+/** Issues the simulated console's next GET_REPORT once \ref SIM_CONSOLE_PERIOD_US has passed. */
+static void Sim_ConsoleTask(void)
+{
+	static uint32_t NextRequestUS;
+	static uint8_t  Interface;
+
+	if (!(SIM_CONSOLE_PERIOD_US) || ((int32_t)(Sim_GetTimeUS() - NextRequestUS) < 0))
+	  return;
+
+	uint8_t                    Report[SIM_MAX_PACKET_SIZE];
+	const USB_Request_Header_t ReportRequest =
+		{
+			.bmRequestType = (REQDIR_DEVICETOHOST | REQTYPE_CLASS | REQREC_INTERFACE),
+			.bRequest      = HID_REQ_GetReport,
+			.wValue        = (1 << 8), /* Input report, no report ID */
+			.wIndex        = Interface,
+			.wLength       = JOYSTICK_REPORT_INPUT_BYTES,
+		};
+
+	Sim_ControlRequest(&ReportRequest, Report, sizeof(Report));
+
+	Interface     = (Interface + 1) % JOYSTICK_INTERFACE_COUNT;
+	NextRequestUS = Sim_GetTimeUS() + SIM_CONSOLE_PERIOD_US;
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t Passes = (argc > 1) ? strtoul(argv[1], NULL, 0) : 100000;
+
+	if ((argc > 2) && !(Trace_OpenWrite(&Trace, argv[2])))
+	{
+		fprintf(stderr, "Unable to create %s\n", argv[2]);
+		return 1;
+	}
+
+	Sim_SetPacketCallback(Sim_OnPacket);
+	Sim_SetPollCallback(Sim_OnPoll);
+	Sim_SetPadSettleUS(0, SIM_CABLE_SETTLE_US);
+
+	SetupHardware();
+	GlobalInterruptEnable();
+
+	/* Let the pads settle, and the first reports reach the host, before the first scripted edge */
+	for (uint16_t Pass = 0; Pass < 1000; Pass++)
+	{
+		if (readJoystickStates())
+		  performDebounce();
+		HID_Task();
+		USB_USBTask();
+
+		Sim_AdvanceTimeUS(SIM_LOOP_US);
+	}
+
+	uint64_t OverheadNS = Sim_TimerOverheadNS();
+	uint32_t StartUS    = Sim_GetTimeUS();
+	uint32_t Frames     = 0;
+
+	for (uint32_t Pass = 0; Pass < Passes; Pass++)
+	{
+		uint64_t Timestamps[SIM_STAGE_Count + 1];
+
+		Sim_ScriptInput();
+		Sim_ConsoleTask();
+
+		Timestamps[0] = Sim_NowNS();
+		bool NewFrame = readJoystickStates();
+		Timestamps[1] = Sim_NowNS();
+		if (NewFrame)
+		  performDebounce();
+		Timestamps[2] = Sim_NowNS();
+		HID_Task();
+		Timestamps[3] = Sim_NowNS();
+		USB_USBTask();
+		Timestamps[4] = Sim_NowNS();
+
+		for (uint8_t Stage = 0; Stage < SIM_STAGE_Count; Stage++)
+		  StageNS[Stage] += (Timestamps[Stage + 1] - Timestamps[Stage]) - OverheadNS;
+
+		if (NewFrame)
+		  Sim_TraceFrame();
+
+		Frames += NewFrame;
+		Sim_AdvanceTimeUS(SIM_LOOP_US);
+	}
+
+	uint32_t ElapsedUS = Sim_GetTimeUS() - StartUS;
+
+	printf("passes: %lu, simulated time: %lu us, loop period: %.1f us, input frames: %lu (%.1f us apart)\n",
+	       (unsigned long)Passes, (unsigned long)ElapsedUS, (double)ElapsedUS / Passes,
+	       (unsigned long)Frames, (Frames) ? (double)ElapsedUS / Frames : 0.0);
+
+	printf("\nhost time per pass (less %lu ns timer overhead):\n", (unsigned long)OverheadNS);
+	for (uint8_t Stage = 0; Stage < SIM_STAGE_Count; Stage++)
+	  printf("  %-20s %8.1f ns\n", StageNames[Stage], (double)StageNS[Stage] / Passes);
+
+	double  MinInputAge = 0.0;
+	double  MaxInputAge = 0.0;
+	uint8_t InputAgePads = 0;
+
+	printf("\nendpoints:\n");
+	for (uint8_t Pad = 0; Pad < HAL_SNES_PORTS; Pad++)
+	{
+		Sim_EndpointStats_t Stats;
+
+		Sim_GetEndpointStats(ENDPOINT_DIR_IN | (Pad + 1), &Stats);
+		printf("  EP%u IN: interval %u ms, %lu packets (%.1f/s), %lu NAKs, report age avg %.0f us, max %lu us\n",
+		       Pad + 1, Stats.IntervalMS, (unsigned long)Stats.Packets, (Stats.Packets * 1e6) / ElapsedUS,
+		       (unsigned long)Stats.NAKs, (Stats.Packets) ? (double)Stats.TotalAgeUS / Stats.Packets : 0.0,
+		       (unsigned long)Stats.MaxAgeUS);
+
+		if (!(Stats.Packets))
+		  continue;
+
+		double InputAge = (double)Stats.TotalInputAgeUS / Stats.Packets;
+
+		printf("         input age avg %.0f us, max %lu us\n", InputAge, (unsigned long)Stats.MaxInputAgeUS);
+
+		if (!(InputAgePads) || (InputAge < MinInputAge))
+		  MinInputAge = InputAge;
+		if (!(InputAgePads) || (InputAge > MaxInputAge))
+		  MaxInputAge = InputAge;
+
+		InputAgePads++;
+	}
+
+	/* Spread of the average input age between the best and worst served pad */
+	if (InputAgePads > 1)
+	  printf("  input age skew across endpoints: %.0f us\n", MaxInputAge - MinInputAge);
+
+	SNESShift_Timing_t         Timing;
+	const USB_Request_Header_t TimingRequest =
+		{
+			.bmRequestType = (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_DEVICE),
+			.bRequest      = SNESSHIFT_REQ_GetTiming,
+			.wLength       = sizeof(Timing),
+		};
+
+	if (Sim_ControlRequest(&TimingRequest, (uint8_t*)&Timing, sizeof(Timing)) == sizeof(Timing))
+	{
+		printf("\nshift clock: %u us per bit after %u calibrations, ports calibrated to", Timing.BitPeriodUS,
+		       Timing.Calibrations);
+		for (uint8_t Port = 0; Port < HAL_SNES_PORTS; Port++)
+		  printf(" %u", Timing.PortBitPeriodUS[Port]);
+		printf(" us\n");
+	}
+
+#if defined(JOYSTICK_MEASUREMENT)
+	Measurement_ReportRate_t  Rate;
+	const USB_Request_Header_t RateRequest =
+		{
+			.bmRequestType = (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_DEVICE),
+			.bRequest      = MEASUREMENT_REQ_GetReportRate,
+			.wLength       = sizeof(Rate),
+		};
+
+	if (Sim_ControlRequest(&RateRequest, (uint8_t*)&Rate, sizeof(Rate)) == sizeof(Rate))
+	{
+		printf("\nfirmware measurement (last %u ms window): max frame period %u us\n",
+		       MEASUREMENT_WINDOW_FRAMES, Rate.MaxFramePeriodUS);
+		for (uint8_t Pad = 0; Pad < HAL_SNES_PORTS; Pad++)
+		  printf("  EP%u IN: %u reports/s\n", Pad + 1, Rate.ReportsPerSecond[Pad]);
+	}
+
+	Measurement_ControlTiming_t ControlTiming;
+	const USB_Request_Header_t  ControlTimingRequest =
+		{
+			.bmRequestType = (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_DEVICE),
+			.bRequest      = MEASUREMENT_REQ_GetControlTiming,
+			.wLength       = sizeof(ControlTiming),
+		};
+
+	if (Sim_ControlRequest(&ControlTimingRequest, (uint8_t*)&ControlTiming, sizeof(ControlTiming)) == sizeof(ControlTiming))
+	  printf("  GET_REPORT: %u served, longest %u us\n", ControlTiming.GetReports, ControlTiming.MaxServiceUS);
+
+	Measurement_HeldTaps_t     HeldTaps;
+	const USB_Request_Header_t HeldTapsRequest =
+		{
+			.bmRequestType = (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_DEVICE),
+			.bRequest      = MEASUREMENT_REQ_GetHeldTaps,
+			.wLength       = sizeof(HeldTaps),
+		};
+
+	if (Sim_ControlRequest(&HeldTapsRequest, (uint8_t*)&HeldTaps, sizeof(HeldTaps)) == sizeof(HeldTaps))
+	{
+		printf("  taps held for the next report:");
+		for (uint8_t Pad = 0; Pad < HAL_SNES_PORTS; Pad++)
+		  printf(" %u", HeldTaps.Taps[Pad]);
+		printf("\n");
+	}
+
+	printf("\nfirmware latency histograms (%u us buckets):\n", MEASUREMENT_LATENCY_BUCKET_US);
+	for (uint8_t Pad = 0; Pad < HAL_SNES_PORTS; Pad++)
+	{
+		Measurement_LatencyHistogram_t Histogram;
+		const USB_Request_Header_t     HistogramRequest =
+			{
+				.bmRequestType = (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_DEVICE),
+				.bRequest      = MEASUREMENT_REQ_GetLatencyHistogram,
+				.wIndex        = Pad,
+				.wLength       = sizeof(Histogram),
+			};
+
+		if (Sim_ControlRequest(&HistogramRequest, (uint8_t*)&Histogram, sizeof(Histogram)) != sizeof(Histogram))
+		  continue;
+
+		printf("  pad %u:", Pad);
+		for (uint8_t Bucket = 0; Bucket < MEASUREMENT_LATENCY_BUCKETS; Bucket++)
+		  printf(" %u", Histogram.Count[Bucket]);
+		printf("\n");
+	}
+#endif
+
+	printf("\ninput-to-host latency:\n");
+	for (uint8_t Pad = 0; Pad < HAL_SNES_PORTS; Pad++)
+	{
+		const Sim_Latency_t* Latency = &PadLatency[Pad].Stats;
+
+		printf("  pad %u: %lu edges, min %lu us, avg %.0f us, p99 %lu us, max %lu us\n", Pad,
+		       (unsigned long)Latency->Samples, (unsigned long)Latency->MinUS,
+		       (Latency->Samples) ? (double)Latency->TotalUS / Latency->Samples : 0.0,
+		       (unsigned long)Sim_LatencyPercentileUS(Latency, 99), (unsigned long)Latency->MaxUS);
+	}
+
+	Trace_Close(&Trace);
+
+	/* The run fails if any pad in use delivered its edges too late */
+	bool Passed = true;
+
+	for (uint8_t Pad = 0; Pad < JOYSTICK_PAD_COUNT; Pad++)
+	  Passed &= Sim_CheckLatency(Pad, &PadLatency[Pad].Stats, SIM_MAX_LATENCY_US, SIM_P99_LATENCY_US);
+
+	return (Passed) ? 0 : 1;
+}
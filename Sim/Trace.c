@@ -0,0 +1,205 @@
+/** \file
+ *
+ *  Reader and writer of the binary input trace format, see Trace.h.
+ */
+
+#include <string.h>
+
+#include "Trace.h"
+
+static const uint8_t TraceMagic[4] = {'S', 'N', 'T', 'R'};
+
+static void Trace_Put16(FILE* const File, const uint16_t Value)
+{
+	fputc(Value & 0xFF, File);
+	fputc(Value >> 8, File);
+}
+
+static bool Trace_Get16(FILE* const File, uint16_t* const Value)
+{
+	int Low  = fgetc(File);
+	int High = fgetc(File);
+
+	if ((Low == EOF) || (High == EOF))
+	  return false;
+
+	*Value = (uint16_t)(Low | (High << 8));
+	return true;
+}
+
+/** Writes a record header, inserting delay records for gaps that do not fit the 16-bit delta. */
+static void Trace_PutHeader(Trace_t* const Trace, const uint8_t Tag, const uint32_t TimeUS)
+{
+	uint32_t DeltaUS = (TimeUS - Trace->TimeUS);
+
+	while (DeltaUS > UINT16_MAX)
+	{
+		fputc(TRACE_TAG_DELAY, Trace->File);
+		Trace_Put16(Trace->File, UINT16_MAX);
+
+		DeltaUS -= UINT16_MAX;
+	}
+
+	fputc(Tag, Trace->File);
+	Trace_Put16(Trace->File, DeltaUS);
+
+	Trace->TimeUS = TimeUS;
+}
+
+/** Writes out polls held back for merging, once a record with a different timestamp follows. */
+static void Trace_FlushPolls(Trace_t* const Trace)
+{
+	if (!(Trace->PendingPollMask))
+	  return;
+
+	Trace_PutHeader(Trace, TRACE_TAG_POLL | Trace->PendingPollMask, Trace->PendingPollUS);
+	Trace->PendingPollMask = 0;
+}
+
+/** Creates a new trace file and writes its header.
+ *
+ *  \return Boolean \c true if the file was created, \c false otherwise
+ */
+bool Trace_OpenWrite(Trace_t* const Trace, const char* const Path)
+{
+	memset(Trace, 0, sizeof(Trace_t));
+
+	if (!(Trace->File = fopen(Path, "wb")))
+	  return false;
+
+	const uint8_t Header[8] = {TraceMagic[0], TraceMagic[1], TraceMagic[2], TraceMagic[3],
+	                           TRACE_VERSION, TRACE_PORTS, 0, 0};
+
+	fwrite(Header, sizeof(Header), 1, Trace->File);
+	Trace->FirstFrame  = true;
+	Trace->PresentMask = TRACE_PRESENT_ALL;
+
+	return true;
+}
+
+/** Records a complete frame. Only the words that changed since the previous frame are stored, and the
+ *  presence of the ports only when it changed.
+ */
+void Trace_WriteFrame(Trace_t* const Trace, const uint32_t TimeUS, const uint16_t* const Words,
+                      const uint8_t PresentMask)
+{
+	uint8_t PortMask = 0;
+
+	Trace_FlushPolls(Trace);
+
+	if (PresentMask != Trace->PresentMask)
+	{
+		Trace_PutHeader(Trace, TRACE_TAG_PRESENT | PresentMask, TimeUS);
+		Trace->PresentMask = PresentMask;
+	}
+
+	for (uint8_t Port = 0; Port < TRACE_PORTS; Port++)
+	{
+		if (Trace->FirstFrame || (Words[Port] != Trace->Words[Port]))
+		  PortMask |= (1 << Port);
+	}
+
+	Trace_PutHeader(Trace, TRACE_TAG_FRAME | PortMask, TimeUS);
+
+	for (uint8_t Port = 0; Port < TRACE_PORTS; Port++)
+	{
+		if (PortMask & (1 << Port))
+		  Trace_Put16(Trace->File, Words[Port]);
+
+		Trace->Words[Port] = Words[Port];
+	}
+
+	Trace->FirstFrame = false;
+}
+
+/** Records host IN polls of the endpoints of the given ports. Polls with the same timestamp share a record. */
+void Trace_WritePoll(Trace_t* const Trace, const uint32_t TimeUS, const uint8_t PortMask)
+{
+	if (Trace->PendingPollMask && (Trace->PendingPollUS != TimeUS))
+	  Trace_FlushPolls(Trace);
+
+	Trace->PendingPollMask |= PortMask;
+	Trace->PendingPollUS    = TimeUS;
+}
+
+/** Opens an existing trace file and checks its header. Traces of earlier versions are read as well.
+ *
+ *  \return Boolean \c true if the file is a trace this reader understands, \c false otherwise
+ */
+bool Trace_OpenRead(Trace_t* const Trace, const char* const Path)
+{
+	uint8_t Header[8];
+
+	memset(Trace, 0, sizeof(Trace_t));
+
+	if (!(Trace->File = fopen(Path, "rb")))
+	  return false;
+
+	if ((fread(Header, sizeof(Header), 1, Trace->File) != 1) || memcmp(Header, TraceMagic, sizeof(TraceMagic)) ||
+	    !(Header[4]) || (Header[4] > TRACE_VERSION) || (Header[5] != TRACE_PORTS))
+	{
+		Trace_Close(Trace);
+		return false;
+	}
+
+	Trace->PresentMask = TRACE_PRESENT_ALL;
+
+	return true;
+}
+
+/** Reads the next frame or poll record, folding delay records into its timestamp.
+ *
+ *  \return Type of the record read, a value from \ref Trace_RecordTypes_t
+ */
+uint8_t Trace_Read(Trace_t* const Trace, Trace_Record_t* const Record)
+{
+	for (;;)
+	{
+		int      Tag = fgetc(Trace->File);
+		uint16_t DeltaUS;
+
+		if ((Tag == EOF) || !(Trace_Get16(Trace->File, &DeltaUS)))
+		  return TRACE_RECORD_End;
+
+		Trace->TimeUS   += DeltaUS;
+		Record->TimeUS   = Trace->TimeUS;
+		Record->PortMask = (Tag & ~TRACE_TAG_MASK);
+
+		switch (Tag & TRACE_TAG_MASK)
+		{
+			case TRACE_TAG_FRAME:
+				for (uint8_t Port = 0; Port < TRACE_PORTS; Port++)
+				{
+					if ((Record->PortMask & (1 << Port)) && !(Trace_Get16(Trace->File, &Trace->Words[Port])))
+					  return TRACE_RECORD_End;
+
+					Record->Words[Port] = Trace->Words[Port];
+				}
+
+				Record->PresentMask = Trace->PresentMask;
+
+				return (Record->Type = TRACE_RECORD_Frame);
+			case TRACE_TAG_POLL:
+				return (Record->Type = TRACE_RECORD_Poll);
+			case TRACE_TAG_PRESENT:
+				Trace->PresentMask = Record->PortMask;
+				continue;
+			case TRACE_TAG_DELAY:
+				continue;
+			default:
+				return (Record->Type = TRACE_RECORD_End);
+		}
+	}
+}
+
+/** Closes a trace, writing out any polls still held back for merging. */
+void Trace_Close(Trace_t* const Trace)
+{
+	if (!(Trace->File))
+	  return;
+
+	Trace_FlushPolls(Trace);
+
+	fclose(Trace->File);
+	Trace->File = NULL;
+}
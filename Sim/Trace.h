@@ -0,0 +1,94 @@
+/** \file
+ *
+ *  Header file for Trace.c, the binary input trace format used to record and replay the joystick pipeline.
+ *
+ *  A trace is an 8 byte header followed by a stream of records, all little endian:
+ *
+ *    - Header: the magic bytes "SNTR", a version byte (\ref TRACE_VERSION), the number of ports, and two
+ *      reserved bytes.
+ *    - Record: one tag byte, a 16-bit delta in microseconds since the previous record, then the payload.
+ *
+ *  Tags:
+ *
+ *    - \ref TRACE_TAG_FRAME | mask: a complete SNES frame. The low nibble flags the ports whose word changed
+ *      since the previous frame, and only those words follow, lowest port first. Each word holds the raw
+ *      16 bits shifted out of the port, bit n for clock n, set while the line was pulled low (pressed).
+ *    - \ref TRACE_TAG_PRESENT | mask: from the next frame on, the ports in the low nibble held their line
+ *      low on the presence clock after the 16 data bits, and all others did not. No payload. Written
+ *      before a frame whenever the set changes; until the first one, every port is present.
+ *    - \ref TRACE_TAG_POLL | mask: the host issued an IN token to the endpoints of the ports in the low
+ *      nibble. No payload.
+ *    - \ref TRACE_TAG_DELAY: no payload, only carries time for gaps longer than a 16-bit delta.
+ *
+ *  An idle frame is 3 bytes and a frame with one changed pad 5, so a 6kHz frame stream stays near 20kB/s.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+	/* Includes: */
+		#include <stdio.h>
+		#include <stdint.h>
+		#include <stdbool.h>
+
+	/* Macros: */
+		/** Version of the trace format written by this file. */
+		#define TRACE_VERSION             2
+
+		/** Number of ports carried by every trace. */
+		#define TRACE_PORTS               4
+
+		#define TRACE_TAG_MASK            0xF0
+		#define TRACE_TAG_FRAME           0x10
+		#define TRACE_TAG_POLL            0x20
+		#define TRACE_TAG_DELAY           0x30
+		#define TRACE_TAG_PRESENT         0x40
+
+		/** Presence mask in force before the first \ref TRACE_TAG_PRESENT record, as in version 1 traces. */
+		#define TRACE_PRESENT_ALL         ((1 << TRACE_PORTS) - 1)
+
+	/* Enums: */
+		/** Kinds of record returned by \ref Trace_Read(). */
+		enum Trace_RecordTypes_t
+		{
+			TRACE_RECORD_End, /**< End of the trace, or a malformed record */
+			TRACE_RECORD_Frame, /**< \c Words and \c PresentMask hold the complete frame, with changed ports in \c PortMask */
+			TRACE_RECORD_Poll, /**< \c PortMask holds the ports whose endpoint was polled */
+		};
+
+	/* Type Defines: */
+		/** State of an open trace, for either reading or writing. */
+		typedef struct
+		{
+			FILE*    File;
+			uint32_t TimeUS; /**< Timestamp of the last record read or written */
+			uint16_t Words[TRACE_PORTS]; /**< Last frame read or written */
+			uint8_t  PresentMask; /**< Presence of the last frame read or written */
+			bool     FirstFrame;
+
+			uint8_t  PendingPollMask; /**< Polls at \c PendingPollUS not yet written, merged into one record */
+			uint32_t PendingPollUS;
+		} Trace_t;
+
+		/** One record returned by \ref Trace_Read(). */
+		typedef struct
+		{
+			uint8_t  Type; /**< Value from \ref Trace_RecordTypes_t */
+			uint32_t TimeUS;
+			uint8_t  PortMask;
+			uint16_t Words[TRACE_PORTS];
+			uint8_t  PresentMask;
+		} Trace_Record_t;
+
+	/* Function Prototypes: */
+		bool    Trace_OpenWrite(Trace_t* const Trace, const char* const Path);
+		void    Trace_WriteFrame(Trace_t* const Trace, const uint32_t TimeUS, const uint16_t* const Words,
+			                         const uint8_t PresentMask);
+		void    Trace_WritePoll(Trace_t* const Trace, const uint32_t TimeUS, const uint8_t PortMask);
+
+		bool    Trace_OpenRead(Trace_t* const Trace, const char* const Path);
+		uint8_t Trace_Read(Trace_t* const Trace, Trace_Record_t* const Record);
+
+		void    Trace_Close(Trace_t* const Trace);
+
+#endif
@@ -0,0 +1,201 @@
+/** \file
+ *
+ *  Off-target replay of a recorded input trace (see Trace.h) through the joystick pipeline. Every frame in
+ *  the trace is stored and de-bounced exactly as readJoystickStates() and performDebounce() would on the
+ *  device, with the simulated timer at the frame's recorded time, and its queued state changes consumed as
+ *  HID_Task() would. At every recorded host poll the polled pads' live reports are brought up to date with
+ *  GetNextReport() from reportedState(), and committed.
+ *
+ *  Each report that differs from the last one seen on that pad is written to stdout as one line:
+ *
+ *    <time in us> <pad> <report bytes in hex>
+ *
+ *  followed by a summary per pad, on lines starting with '#':
+ *
+ *    - Latency from the first frame in which a pad's raw input differed from its de-bounced state, to the
+ *      first poll whose report changed. Raw changes that bounce back before being accepted are not timed.
+ *    - Unreported presses: raw button presses that were released again before any poll saw them in the
+ *      reported state, i.e. taps dropped by the de-bounce (or glitches it was right to drop). Taps the
+ *      de-bounce accepted are held until a report carries them, so they are not among these.
+ *
+ *  The replay exits with a non-zero status if any pad in use delivered no edge, or its latency exceeded
+ *  \ref SIM_MAX_LATENCY_US on any edge or \ref SIM_P99_LATENCY_US at the 99th percentile.
+ *
+ *  The replay hands the host a report at each poll, so it leaves out the endpoint
+ *  bank and idle keepalive modelled by the full simulator. Two replays of the same trace are identical,
+ *  so diffing the output before and after a de-bounce or mapping change shows exactly what it changed.
+ *
+ *  Usage: JoystickReplay <trace>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Sim.h"
+#include "Trace.h"
+#include "Joystick.h"
+
+/** Replay bookkeeping for one pad. */
+typedef struct
+{
+	USB_JoystickReport_Input_t PreviousReport;
+
+	uint16_t RawState;
+	uint16_t PressedSinceReport;
+	uint32_t UnreportedPresses;
+
+	bool          EdgePending;
+	uint32_t      EdgeTimeUS;
+	Sim_Latency_t Latency;
+} Replay_Pad_t;
+
+static Replay_Pad_t ReplayPads[TRACE_PORTS];
+
+static void Replay_Frame(const Trace_Record_t* const Record)
+{
+	uint16_t PressedStates[TRACE_PORTS];
+
+	for (uint8_t Pad = 0; Pad < JOYSTICK_PAD_COUNT; Pad++)
+	{
+		Replay_Pad_t* ReplayPad = &ReplayPads[Pad];
+		uint16_t      Raw       = (Record->Words[Pad] & BUTTON_MASK);
+
+		if (!(ReplayPad->EdgePending) && (Raw != joyStick[Pad].state))
+		{
+			ReplayPad->EdgePending = true;
+			ReplayPad->EdgeTimeUS  = Record->TimeUS;
+		}
+
+		ReplayPad->PressedSinceReport |= (Raw & ~ReplayPad->RawState);
+		ReplayPad->RawState            = Raw;
+
+		PressedStates[Pad] = Record->Words[Pad];
+	}
+
+	/* De-bounce windows are timed against the recorded frame times */
+	Sim_AdvanceTimeUS(Record->TimeUS - Sim_GetTimeUS());
+
+	storePhysicalStates(PressedStates, Record->PresentMask);
+	performDebounce();
+
+	struct joystickSnapshot Snapshot;
+
+	readSnapshot(&Snapshot);
+	consumeEvents(&Snapshot);
+}
+
+static void Replay_Poll(const Trace_Record_t* const Record)
+{
+	struct joystickSnapshot Snapshot;
+
+	readSnapshot(&Snapshot);
+
+	for (uint8_t Pad = 0; Pad < JOYSTICK_PAD_COUNT; Pad++)
+	{
+		if (!(Record->PortMask & (1 << Pad)))
+		  continue;
+
+		Replay_Pad_t*                     ReplayPad = &ReplayPads[Pad];
+		const USB_JoystickReport_Input_t* Report    = &joystickReports[Pad];
+
+		const uint16_t Reported = reportedState(Pad);
+
+		GetNextReport(Pad, Reported);
+		reportCommitted(Pad, Snapshot.state[Pad]);
+
+		if (memcmp(Report, &ReplayPad->PreviousReport, sizeof(USB_JoystickReport_Input_t)))
+		{
+			const uint8_t* ReportBytes = (const uint8_t*)Report;
+
+			ReplayPad->PreviousReport = *Report;
+
+			printf("%lu %u ", (unsigned long)Record->TimeUS, Pad);
+			for (uint8_t Byte = 0; Byte < sizeof(USB_JoystickReport_Input_t); Byte++)
+			  printf("%02X", ReportBytes[Byte]);
+			printf("\n");
+
+			if (ReplayPad->EdgePending)
+			{
+				Sim_AddLatency(&ReplayPad->Latency, Record->TimeUS - ReplayPad->EdgeTimeUS);
+				ReplayPad->EdgePending = false;
+			}
+		}
+		else if (ReplayPad->RawState == joyStick[Pad].state)
+		{
+			/* Input bounced back before it was accepted, nothing is in flight */
+			ReplayPad->EdgePending = false;
+		}
+
+		/* Presses the host has now seen are accounted for, and those already released never will be */
+		ReplayPad->PressedSinceReport &= ~Reported;
+
+		uint16_t Dropped = (ReplayPad->PressedSinceReport & ~ReplayPad->RawState);
+
+		ReplayPad->UnreportedPresses  += __builtin_popcount(Dropped);
+		ReplayPad->PressedSinceReport &= ~Dropped;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Trace_t        Trace;
+	Trace_Record_t Record;
+	uint32_t       Frames = 0;
+	uint32_t       Polls  = 0;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <trace>\n", argv[0]);
+		return 1;
+	}
+
+	if (!(Trace_OpenRead(&Trace, argv[1])))
+	{
+		fprintf(stderr, "%s is not an input trace of version %u or earlier\n", argv[1], TRACE_VERSION);
+		return 1;
+	}
+
+	for (;;)
+	{
+		uint8_t Type = Trace_Read(&Trace, &Record);
+
+		if (Type == TRACE_RECORD_Frame)
+		{
+			Replay_Frame(&Record);
+			Frames++;
+		}
+		else if (Type == TRACE_RECORD_Poll)
+		{
+			Replay_Poll(&Record);
+			Polls++;
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	Trace_Close(&Trace);
+
+	printf("# %lu frames, %lu poll records, %lu us\n", (unsigned long)Frames, (unsigned long)Polls,
+	       (unsigned long)Trace.TimeUS);
+
+	bool Passed = true;
+
+	for (uint8_t Pad = 0; Pad < JOYSTICK_PAD_COUNT; Pad++)
+	{
+		Replay_Pad_t*        ReplayPad = &ReplayPads[Pad];
+		const Sim_Latency_t* Latency   = &ReplayPad->Latency;
+
+		printf("# pad %u: %lu edges, latency min %lu us, avg %.0f us, p99 %lu us, max %lu us, %lu unreported presses\n",
+		       Pad, (unsigned long)Latency->Samples, (unsigned long)Latency->MinUS,
+		       (Latency->Samples) ? (double)Latency->TotalUS / Latency->Samples : 0.0,
+		       (unsigned long)Sim_LatencyPercentileUS(Latency, 99), (unsigned long)Latency->MaxUS,
+		       (unsigned long)ReplayPad->UnreportedPresses);
+
+		Passed &= Sim_CheckLatency(Pad, Latency, SIM_MAX_LATENCY_US, SIM_P99_LATENCY_US);
+	}
+
+	return (Passed) ? 0 : 1;
+}
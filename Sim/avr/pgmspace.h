@@ -0,0 +1,19 @@
+/** \file
+ *
+ *  Host-side stand-in for avr-libc's program memory helpers. The simulator has a single flat address
+ *  space, so flash-resident data is ordinary const data and reads from it are plain dereferences.
+ */
+
+#ifndef _SIM_PGMSPACE_H_
+#define _SIM_PGMSPACE_H_
+
+	/* Includes: */
+		#include <stdint.h>
+
+	/* Macros: */
+		#define PROGMEM
+
+		#define pgm_read_byte(Address)   (*(const uint8_t*)(Address))
+		#define pgm_read_word(Address)   (*(const uint16_t*)(Address))
+
+#endif